@@ -11,383 +11,5389 @@ ASSUMPTIONS
 */
 
 #include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <regex>
+#include <span>
 #include <sstream>
-#include <stack>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 #include <variant>
 #include <vector>
 
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Bounded lock-free queue for one producer and one consumer thread
+template <typename T>
+class SpscQueue {
+   public:
+    explicit SpscQueue(std::size_t capacity) : slots(capacity) {}
+
+    bool try_push(T& item)
+    {
+        auto tail = write_index.load(std::memory_order_relaxed);
+        if (tail - read_index.load(std::memory_order_acquire) ==
+            slots.size()) {
+            return false;
+        }
+        slots[tail % slots.size()] = std::move(item);
+        write_index.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& item)
+    {
+        auto head = read_index.load(std::memory_order_relaxed);
+        if (head == write_index.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(slots[head % slots.size()]);
+        read_index.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    void push(T item)
+    {
+        while (!try_push(item)) std::this_thread::yield();
+    }
+
+    // Waits for the next item. Returns false once closed and drained
+    bool pop(T& item)
+    {
+        while (!try_pop(item)) {
+            if (closed.load(std::memory_order_acquire)) return try_pop(item);
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    // Called by the producer after its last push
+    void close() { closed.store(true, std::memory_order_release); }
+
+   private:
+    std::vector<T> slots;
+    alignas(64) std::atomic<std::size_t> read_index{0};
+    alignas(64) std::atomic<std::size_t> write_index{0};
+    std::atomic<bool> closed{false};
+};
+
+// Minimal FlatBuffers encoder for Arrow IPC metadata. Objects are laid out
+// front to back: a parent is written first and its offset slots are
+// patched once its children have been written after it, so every offset
+// points forward as the format requires. Values are little-endian
+class FlatBufferWriter {
+   public:
+    // Scalar table field of 1, 2, 4 or 8 bytes, or an offset slot if size
+    // is 0
+    struct Field {
+        int id;
+        int size;
+        std::int64_t value = 0;
+    };
+
+    FlatBufferWriter() : bytes(4, '\0') {}
+
+    // Writes a table and appends the positions of its offset slots to
+    // slots, in the order the fields were given
+    std::size_t table(const std::vector<Field>& fields,
+                      std::vector<std::size_t>& slots)
+    {
+        int max_id = -1;
+        for (const auto& field : fields) max_id = std::max(max_id, field.id);
+
+        // Place wide fields first to keep padding down
+        auto order = fields;
+        std::stable_sort(order.begin(), order.end(),
+                         [](const Field& a, const Field& b) {
+                             return width(a) > width(b);
+                         });
+        std::vector<std::size_t> field_offsets(max_id + 1, 0);
+        std::size_t table_size = 4;
+        for (const auto& field : order) {
+            table_size = (table_size + width(field) - 1) / width(field) *
+                         width(field);
+            field_offsets[field.id] = table_size;
+            table_size += width(field);
+        }
+
+        align(2);
+        auto vtable = bytes.size();
+        put(4 + 2 * (max_id + 1), 2);
+        put(static_cast<std::int64_t>(table_size), 2);
+        for (auto offset : field_offsets) {
+            put(static_cast<std::int64_t>(offset), 2);
+        }
+
+        align(8);
+        auto table = bytes.size();
+        put(static_cast<std::int64_t>(table - vtable), 4);
+        bytes.resize(table + table_size, '\0');
+        for (const auto& field : fields) {
+            auto at = table + field_offsets[field.id];
+            if (field.size == 0) {
+                slots.push_back(at);
+            }
+            else {
+                put_at(at, field.value, field.size);
+            }
+        }
+        return table;
+    }
+
+    std::size_t string(const std::string& text)
+    {
+        align(4);
+        auto at = bytes.size();
+        put(static_cast<std::int64_t>(text.size()), 4);
+        bytes += text;
+        bytes += '\0';
+        return at;
+    }
+
+    // Vector of offsets. Slot i is at the returned position + 4 + 4 * i
+    std::size_t offsets(std::size_t count)
+    {
+        align(4);
+        auto at = bytes.size();
+        put(static_cast<std::int64_t>(count), 4);
+        bytes.resize(bytes.size() + 4 * count, '\0');
+        return at;
+    }
+
+    // Vector of count structs made of the given 8-byte words
+    std::size_t structs(const std::vector<std::int64_t>& words,
+                        std::size_t count)
+    {
+        while ((bytes.size() + 4) % 8 != 0) bytes += '\0';
+        auto at = bytes.size();
+        put(static_cast<std::int64_t>(count), 4);
+        for (auto word : words) put(word, 8);
+        return at;
+    }
+
+    void patch(std::size_t slot, std::size_t target)
+    {
+        put_at(slot, static_cast<std::int64_t>(target - slot), 4);
+    }
+
+    void set_root(std::size_t table) { patch(0, table); }
+
+    // The encoded buffer, padded to a multiple of 8 bytes
+    const std::string& finish()
+    {
+        align(8);
+        return bytes;
+    }
+
+   private:
+    std::string bytes;
+
+    static std::size_t width(const Field& field)
+    {
+        return field.size == 0 ? 4 : field.size;
+    }
+
+    void align(std::size_t n)
+    {
+        while (bytes.size() % n != 0) bytes += '\0';
+    }
+
+    void put(std::int64_t value, int size)
+    {
+        bytes.resize(bytes.size() + size, '\0');
+        put_at(bytes.size() - size, value, size);
+    }
+
+    void put_at(std::size_t at, std::int64_t value, int size)
+    {
+        for (int i = 0; i < size; ++i) {
+            bytes[at + i] = static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+    }
+};
+
+// Engine structures whose memory is accounted for
+enum class MemoryArea {
+    Cells,
+    Dependencies,
+    Formulas,
+    Programs,
+    Evaluation,  // graphs and plans built to evaluate the sheet
+    Parsing,     // buffers of parser threads
+    Count
+};
+
+// Memory held by one area of a sheet. Bytes are what its allocations
+// hold, used bytes what the elements constructed in them take; the rest
+// is spare capacity, hash buckets and node links. Each area sits on its
+// own cache line, as parser threads allocate concurrently
+struct alignas(64) MemoryCounters {
+    std::atomic<std::size_t> bytes{0};
+    std::atomic<std::size_t> peak_bytes{0};
+    std::atomic<std::size_t> used_bytes{0};
+    std::atomic<std::size_t> blocks{0};
+    std::atomic<std::size_t> total_blocks{0};
+};
+
+// Counters of every area of one sheet
+struct MemoryAccount {
+    MemoryCounters areas[static_cast<int>(MemoryArea::Count)];
+
+    // Bytes allocated less bytes freed in every area since the sheet began
+    // its current load, what the memory budget limits
+    alignas(64) std::atomic<std::ptrdiff_t> load_bytes{0};
+
+    MemoryCounters& operator[](MemoryArea area)
+    {
+        return areas[static_cast<int>(area)];
+    }
+};
+
+// Allocator of the structures in an area, counting what they hold in the
+// account it was made from. Containers keep the account they were made
+// with: it is not propagated on assignment or swap, and elements built in
+// a container get its account too, so a column or a formula's dependents
+// count where the map holding them does. A default-constructed allocator
+// counts nothing. Strings do not construct their characters through the
+// allocator, so their text counts as capacity only
+template <typename T, MemoryArea area>
+struct CountingAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = CountingAllocator<U, area>;
+    };
+
+    MemoryAccount* account = nullptr;
+
+    CountingAllocator() = default;
+    CountingAllocator(MemoryAccount& account) : account(&account) {}
+    template <typename U, MemoryArea other_area>
+    CountingAllocator(const CountingAllocator<U, other_area>& other)
+        : account(other.account)
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        auto* p = std::allocator<T>().allocate(n);
+        if (account == nullptr) return p;
+        auto& counters = (*account)[area];
+        auto size = n * sizeof(T);
+        auto bytes =
+            counters.bytes.fetch_add(size, std::memory_order_relaxed) + size;
+        auto peak = counters.peak_bytes.load(std::memory_order_relaxed);
+        while (bytes > peak && !counters.peak_bytes.compare_exchange_weak(
+                                   peak, bytes, std::memory_order_relaxed)) {
+        }
+        counters.blocks.fetch_add(1, std::memory_order_relaxed);
+        counters.total_blocks.fetch_add(1, std::memory_order_relaxed);
+        account->load_bytes.fetch_add(static_cast<std::ptrdiff_t>(size),
+                                      std::memory_order_relaxed);
+        return p;
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        std::allocator<T>().deallocate(p, n);
+        if (account == nullptr) return;
+        auto& counters = (*account)[area];
+        auto size = n * sizeof(T);
+        counters.bytes.fetch_sub(size, std::memory_order_relaxed);
+        counters.blocks.fetch_sub(1, std::memory_order_relaxed);
+        account->load_bytes.fetch_sub(static_cast<std::ptrdiff_t>(size),
+                                      std::memory_order_relaxed);
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        std::uninitialized_construct_using_allocator(
+            p, *this, std::forward<Args>(args)...);
+        if (account == nullptr) return;
+        (*account)[area].used_bytes.fetch_add(sizeof(U),
+                                              std::memory_order_relaxed);
+    }
+
+    template <typename U>
+    void destroy(U* p)
+    {
+        p->~U();
+        if (account == nullptr) return;
+        (*account)[area].used_bytes.fetch_sub(sizeof(U),
+                                              std::memory_order_relaxed);
+    }
+
+    template <typename U, MemoryArea other_area>
+    bool operator==(const CountingAllocator<U, other_area>& other) const
+    {
+        return account == other.account;
+    }
+};
+
 class Spreadsheet {
    public:
-    void parse_input(std::string);
+    Spreadsheet() = default;
+    Spreadsheet(Spreadsheet&&) = default;
+    // Containers keep counting into the account they were made with, so
+    // one sheet cannot be assigned over another
+    Spreadsheet& operator=(Spreadsheet&&) = delete;
+
+    // Values of one cell across a batch of scenarios, and which of them
+    // are not numbers
+    struct ScenarioValues {
+        std::vector<int> values;
+        std::vector<char> errors;
+    };
+
+    // Distribution of a random input: integers uniform over [a, b], or
+    // normal with mean a and standard deviation b, rounded
+    struct Distribution {
+        enum class Kind { Uniform, Normal };
+        Kind kind = Kind::Uniform;
+        double a = 0;
+        double b = 0;
+    };
+
+    // Statistics of an output over simulated draws. Draws where it is not
+    // a number only count towards errors
+    struct SampleStats {
+        std::size_t count = 0;
+        std::size_t errors = 0;
+        double mean = 0;
+        double variance = 0;
+        std::vector<int> percentiles;
+    };
+
+    // Shape of the evaluation work in the graph. Formulas are placed in
+    // levels, each after the formulas it reads, and cost is formula_cost.
+    // The speedup bound is total cost over critical path cost, what
+    // unlimited threads could reach
+    struct GraphReport {
+        std::size_t cells = 0;
+        std::size_t formulas = 0;
+        std::size_t cycle_cells = 0;
+        std::vector<std::size_t> level_widths;
+        std::int64_t total_cost = 0;
+        std::int64_t critical_path_cost = 0;
+        std::vector<std::string> critical_path;
+        double max_speedup = 1;
+    };
+
+    // What parse_input would load from a file. Memory is an estimate of
+    // what the sheet holds once the file is loaded and evaluated, from
+    // the sizes of the containers involved
+    struct SheetProfile {
+        std::size_t rows = 0;
+        std::size_t columns = 0;
+        std::size_t literal_cells = 0;
+        std::size_t formula_cells = 0;
+        std::size_t formula_tokens = 0;
+        std::size_t references = 0;
+        std::size_t referenced_cells = 0;  // read by formulas, not formulas
+        std::size_t estimated_bytes = 0;
+    };
+
+    bool parse_input(std::string);
+    GraphReport analyse_input(std::string);
+    SheetProfile profile_input(std::string) const;
+    GraphReport graph_report() const;
+    void print_report(const GraphReport&, std::ostream& = std::cout) const;
+    bool import_columns(std::vector<std::span<const int>>,
+                        std::vector<std::span<const std::string>> = {});
+    bool parse_input_pipelined(std::string, std::ostream& = std::cout);
+    bool parse_and_print(std::string, std::ostream& = std::cout);
     void print_output();
+    bool write_output(std::string);
+    bool export_arrow(std::string);
+    bool fill_formula(const std::string&, int, int, const std::string&);
+    void recalculate();
+    Spreadsheet clone();
+    void set_value(const std::string&, int);
+    void set_value(int col, int row, int value)
+    {
+        set_value(coords_to_address({col, row}), value);
+    }
+
+    // What a cell holds, as seen from outside the engine
+    enum class CellKind : std::uint8_t { Number, Empty, Error };
+    CellKind read_cell(int, int, int&) const;
+    bool goal_seek(const std::string&, const std::string&, int, int, int);
+    std::vector<std::string> dependents_of(const std::string&);
+    std::vector<std::string> precedents_of(const std::string&);
+    std::vector<ScenarioValues> evaluate_scenarios(
+        const std::vector<std::pair<std::string, std::vector<int>>>&,
+        const std::vector<std::string>&);
+    std::vector<SampleStats> simulate(
+        const std::vector<std::pair<std::string, Distribution>>&,
+        const std::vector<std::string>&, std::size_t, std::uint64_t,
+        const std::vector<double>& = {5, 50, 95});
+    void insert_rows(int row, int count)
+    {
+        if (count > 0) shift_cells(true, row, count);
+    }
+    void delete_rows(int row, int count)
+    {
+        if (count > 0) shift_cells(true, row, -count);
+    }
+    void insert_columns(int col, int count)
+    {
+        if (count > 0) shift_cells(false, col, count);
+    }
+    void delete_columns(int col, int count)
+    {
+        if (count > 0) shift_cells(false, col, -count);
+    }
+    void set_thread_count(unsigned count)
+    {
+        thread_count = std::max(count, 1u);
+    }
+    void set_stream_window(int rows) { stream_window = std::max(rows, 0); }
+    void set_memory_budget(std::size_t bytes) { memory_budget = bytes; }
+    void set_iteration(int max_iterations, int max_change = 0)
+    {
+        iteration_limit = std::max(max_iterations, 0);
+        iteration_tolerance = std::max(max_change, 0);
+    }
+    // Memory held by an area of this sheet, as counted by the allocators
+    // of its structures. Bytes are capacity, used bytes the elements in
+    // it. Blocks are live allocations. State shared with clones counts
+    // towards the sheet it was cloned from
+    struct MemoryUsage {
+        std::size_t bytes = 0;
+        std::size_t peak_bytes = 0;
+        std::size_t used_bytes = 0;
+        std::size_t blocks = 0;
+        std::size_t total_blocks = 0;
+    };
+
+    MemoryUsage memory_usage(MemoryArea) const;
+    std::size_t accounted_bytes() const;
+    void print_memory(std::ostream& = std::cout) const;
+
     void clear()
     {
-        cells.clear();
-        dependencies.clear();
-        max_col = 0;
-        max_row = 0;
+        cells.clear();
+        dependencies.clear();
+        programs.clear();
+        adopted.clear();
+        base.reset();
+        cleared.clear();
+        changed.clear();
+        reachability.reset();
+        placement.reset();
+        max_col = 0;
+        max_row = 0;
+    }
+
+   private:
+    enum class CellState { Empty, Error };
+
+    using CellValue = std::variant<int, CellState>;
+
+    // Postfix formula compiled once at parse time. Cell references are
+    // resolved to coordinates so evaluation does no string parsing
+    struct Op {
+        enum class Kind {
+            Number,
+            Reference,
+            Add,
+            Subtract,
+            Multiply,
+            Divide,
+            Invalid
+        };
+        Kind kind = Kind::Invalid;
+        int value = 0;
+        std::pair<int, int> coords;
+    };
+    // Vector counted in an area of the sheet's memory account
+    template <typename T, MemoryArea area>
+    using CountedVector = std::vector<T, CountingAllocator<T, area>>;
+
+    using Program = CountedVector<Op, MemoryArea::Programs>;
+    using Programs = std::unordered_map<
+        std::string, Program, std::hash<std::string>,
+        std::equal_to<std::string>,
+        CountingAllocator<std::pair<const std::string, Program>,
+                          MemoryArea::Programs>>;
+
+    using Column = std::unordered_map<
+        int, CellValue, std::hash<int>, std::equal_to<int>,
+        CountingAllocator<std::pair<const int, CellValue>, MemoryArea::Cells>>;
+    using Cells = std::unordered_map<
+        int, Column, std::hash<int>, std::equal_to<int>,
+        CountingAllocator<std::pair<const int, Column>, MemoryArea::Cells>>;
+
+    // Operand of a formula: a cell, a number in an adopted column, or
+    // neither if the referenced cell is undefined
+    struct Operand {
+        const CellValue* cell = nullptr;
+        const int* number = nullptr;
+    };
+
+    // Cell queued for evaluation. Its operands are stored contiguously in
+    // the plan
+    struct Step {
+        CellValue* target;
+        const Program* program;  // nullptr unless a formula
+        std::size_t first_operand;
+        std::size_t operand_count;
+    };
+
+    struct Plan {
+        explicit Plan(MemoryAccount& account)
+            : steps(account), operands(account)
+        {
+        }
+
+        CountedVector<Step, MemoryArea::Evaluation> steps;
+        CountedVector<Operand, MemoryArea::Evaluation> operands;
+    };
+
+    using Formula =
+        std::basic_string<char, std::char_traits<char>,
+                          CountingAllocator<char, MemoryArea::Formulas>>;
+    using Dependents =
+        std::vector<std::string,
+                    CountingAllocator<std::string, MemoryArea::Dependencies>>;
+    using Dependencies = std::unordered_map<
+        std::string, std::pair<Formula, Dependents>, std::hash<std::string>,
+        std::equal_to<std::string>,
+        CountingAllocator<
+            std::pair<const std::string, std::pair<Formula, Dependents>>,
+            MemoryArea::Dependencies>>;
+
+    // What parse_rows will store from a file, counted before parsing so
+    // the maps are sized once and the load can be refused up front.
+    // Formula text counts only where it is too long to sit in the string
+    struct InputCounts {
+        std::vector<std::size_t> column_cells;
+        std::size_t cells = 0;
+        std::size_t formula_cells = 0;
+        std::size_t formula_tokens = 0;
+        std::size_t references = 0;
+        std::size_t text_bytes = 0;
+
+        void merge(const InputCounts& other)
+        {
+            if (column_cells.size() < other.column_cells.size()) {
+                column_cells.resize(other.column_cells.size());
+            }
+            for (std::size_t col = 0; col < other.column_cells.size();
+                 ++col) {
+                column_cells[col] += other.column_cells[col];
+            }
+            cells += other.cells;
+            formula_cells += other.formula_cells;
+            formula_tokens += other.formula_tokens;
+            references += other.references;
+            text_bytes += other.text_bytes;
+        }
+    };
+
+    // Counts the bytes of a file, fed in order in pieces of any size,
+    // splitting them as parse_rows does. A cell with a letter is a
+    // formula, and its tokens of letters followed by digits are references
+    class InputScanner {
+       public:
+        void scan(std::string_view);
+        InputCounts finish();
+
+       private:
+        // Token states: nothing read, letters, letters then digits,
+        // neither
+        enum { Start, Letters, Digits, Other } token = Start;
+        InputCounts counts;
+        std::size_t col = 0;
+        std::size_t cell_length = 0;
+        std::size_t cell_tokens = 0;
+        std::size_t cell_references = 0;
+        bool formula = false;
+
+        void end_token();
+        void end_cell();
+    };
+
+    // Bytes read at a time when counting a file
+    static constexpr std::size_t count_block_size = 1 << 20;
+
+    // What the heap adds to every block it hands out: its header and
+    // rounding
+    static constexpr std::size_t heap_block = 2 * sizeof(void*);
+
+    // Output of one parser thread, partitioned by the shard that merges
+    // it: cells by column, formulas and edges by address hash
+    struct ParseBuffer {
+        struct Shard {
+            explicit Shard(MemoryAccount& account)
+                : values(account), formulas(account), edges(account)
+            {
+            }
+
+            CountedVector<std::tuple<int, int, CellValue>, MemoryArea::Parsing>
+                values;
+            CountedVector<std::tuple<std::string, std::string, Program>,
+                          MemoryArea::Parsing>
+                formulas;  // address, text, program
+            CountedVector<std::pair<std::string, std::string>,
+                          MemoryArea::Parsing>
+                edges;  // precedent, dependent
+        };
+
+        ParseBuffer() = default;  // for queue slots, counting nothing
+        explicit ParseBuffer(MemoryAccount& account) : shards(account) {}
+
+        CountedVector<Shard, MemoryArea::Parsing> shards;
+        int max_col = 0;
+    };
+
+    // Formulas left to evaluate in each row while printing during
+    // evaluation. Rows up to next_row have been handed to the writer
+    struct RowProgress {
+        SpscQueue<int>* printable;
+        std::vector<int> node_rows;
+        std::vector<std::atomic<int>> pending;
+        int next_row = 0;
+    };
+
+    // Row handed from the parser to the evaluator in pipelined mode
+    struct ParsedRow {
+        int row = 0;
+        int width = 0;
+        ParseBuffer buffer;
+    };
+
+    // How many formulas ahead of the current one have their operands
+    // prefetched during evaluation
+    static constexpr std::size_t prefetch_distance = 8;
+
+    // Dense view of dependencies for graph passes. Node ids index
+    // addresses; downstream edges are deduplicated and stored in CSR form
+    struct DependencyGraph {
+        using Addresses = CountedVector<std::string, MemoryArea::Evaluation>;
+        using Ids = std::unordered_map<
+            std::string, int, std::hash<std::string>,
+            std::equal_to<std::string>,
+            CountingAllocator<std::pair<const std::string, int>,
+                              MemoryArea::Evaluation>>;
+
+        explicit DependencyGraph(MemoryAccount& account)
+            : addresses(account),
+              ids(account),
+              programs(account),
+              edge_offsets(account),
+              edges(account)
+        {
+        }
+
+        Addresses addresses;
+        Ids ids;
+        // nullptr unless a formula
+        CountedVector<const Program*, MemoryArea::Evaluation> programs;
+        CountedVector<int, MemoryArea::Evaluation> edge_offsets;
+        CountedVector<int, MemoryArea::Evaluation> edges;
+    };
+
+    // Evaluation order of graph nodes, precedents first, and whether each
+    // node lies on a cycle. Cycle members are excluded from evaluation.
+    // Nodes of one strongly connected component share the id of one of
+    // them as component
+    struct GraphOrder {
+        std::vector<int> order;
+        std::vector<char> on_cycle;
+        std::vector<int> component;
+    };
+
+    // Cells reachable from each component of the condensed graph in one
+    // direction. Components are numbered in post-order of a depth-first
+    // forest, so a component and the ones below it in the forest form a
+    // range of numbers. Each holds the merged ranges it reaches
+    struct Labelling {
+        std::vector<int> number;  // by component
+        std::vector<int> member_offsets;  // by number, into members
+        std::vector<int> members;
+        std::vector<int> interval_offsets;  // by number, into intervals
+        std::vector<std::pair<int, int>> intervals;
+    };
+
+    // Transitive dependents and precedents of every cell in the graph,
+    // built on the first query after the formulas change
+    struct Reachability {
+        explicit Reachability(MemoryAccount& account)
+            : addresses(account), ids(account)
+        {
+        }
+
+        DependencyGraph::Addresses addresses;  // taken from the graph
+        DependencyGraph::Ids ids;
+        std::vector<char> on_cycle;
+        std::vector<int> component;  // numbered in evaluation order
+        Labelling dependents;
+        Labelling precedents;
+    };
+
+    // The columns with an address of the graph in each row, and the rows
+    // with one in each column, both in order, so an insert or delete finds
+    // the addresses that move without scanning the graph
+    struct Placement {
+        std::map<int, std::vector<int>> rows;
+        std::map<int, std::vector<int>> columns;
+    };
+
+    // Formula cells evaluated back to back as one scheduling unit
+    struct Task {
+        std::vector<int> nodes;
+        int cost = 0;
+    };
+
+    // Parallel evaluation splits each level into about this many batches
+    // per thread, so threads that finish early can pick up more work
+    static constexpr int batches_per_thread = 4;
+
+    // Fewest items a parallel loop hands to each thread. Smaller loops run
+    // on the calling thread
+    static constexpr std::size_t parallel_grain = 4096;
+
+    // Bytes formatted by a thread before write_output writes them out
+    static constexpr std::size_t write_block_size = 1 << 20;
+
+    // Scenarios evaluated together by evaluate_scenarios. Bounds the
+    // values held per formula while walking the order once
+    static constexpr std::size_t scenario_block = 256;
+
+    // Formulas downstream of a set of inputs, ready to run over blocks of
+    // scenarios. Reference ops hold the slot they read in value
+    struct ScenarioPlan {
+        struct Formula {
+            Program program;
+            int slot;
+            bool valid;
+        };
+        std::vector<Formula> formulas;
+        std::vector<int> inputs;
+        std::vector<int> outputs;  // -1 if the output does not vary
+        std::size_t slot_count = 0;
+        std::size_t max_depth = 1;
+    };
+
+    // Values and error flags of every slot of a plan, then of its stack,
+    // scenario_block lanes each
+    struct ScenarioBlock {
+        std::vector<int> values;
+        std::vector<char> errors;
+
+        explicit ScenarioBlock(const ScenarioPlan& plan)
+            : values((plan.slot_count + plan.max_depth) * scenario_block),
+              errors(values.size())
+        {
+        }
+
+        static std::size_t lane(std::size_t slot)
+        {
+            return slot * scenario_block;
+        }
+    };
+
+    // Random stream of one simulated draw (SplitMix64)
+    struct SplitMix64 {
+        std::uint64_t state;
+
+        explicit SplitMix64(std::uint64_t seed) : state(seed) {}
+
+        std::uint64_t next()
+        {
+            std::uint64_t z = state += 0x9e3779b97f4a7c15;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            return z ^ (z >> 31);
+        }
+
+        // Uniform in [0, 1)
+        double uniform() { return static_cast<double>(next() >> 11) * 0x1p-53; }
+
+        // Uniform in [0, range) for range up to 2^32, without the bias of
+        // next() % range (Lemire). The high half of x * range is the
+        // draw; low halves below 2^32 % range are redrawn so every draw
+        // is hit by equally many x
+        std::uint64_t below(std::uint64_t range)
+        {
+            std::uint64_t product = (next() >> 32) * range;
+            if ((product & 0xffffffff) < range) {
+                std::uint64_t threshold = ((std::uint64_t{1} << 32) - range) %
+                                          range;
+                while ((product & 0xffffffff) < threshold) {
+                    product = (next() >> 32) * range;
+                }
+            }
+            return product >> 32;
+        }
+
+        int draw(const Distribution& distribution)
+        {
+            if (distribution.kind == Distribution::Kind::Normal) {
+                // Box-Muller
+                double u = 1 - uniform();
+                double v = uniform();
+                return static_cast<int>(std::lround(
+                    distribution.a +
+                    distribution.b * std::sqrt(-2 * std::log(u)) *
+                        std::cos(2 * 3.14159265358979323846 * v)));
+            }
+            auto low = static_cast<std::int64_t>(std::ceil(distribution.a));
+            auto high = static_cast<std::int64_t>(std::floor(distribution.b));
+            low = std::max<std::int64_t>(low, std::numeric_limits<int>::min());
+            high =
+                std::min<std::int64_t>(high, std::numeric_limits<int>::max());
+            if (high <= low) return static_cast<int>(low);
+            auto range = static_cast<std::uint64_t>(high - low + 1);
+            return static_cast<int>(low +
+                                    static_cast<std::int64_t>(below(range)));
+        }
+    };
+
+    // Counts of simulated values in a fixed set of buckets, so memory does
+    // not grow with the number of distinct values. Magnitudes below 256
+    // have a bucket each; larger ones share buckets by their top 8 bits,
+    // which keeps a bucket's middle within 1/256 of any value in it.
+    // Bucket order follows value order
+    struct ValueHistogram {
+        static constexpr int exact = 256;
+        static constexpr int per_sign = exact + 24 * exact / 2;
+
+        std::vector<std::size_t> counts =
+            std::vector<std::size_t>(2 * per_sign, 0);
+
+        static int magnitude_bucket(std::uint32_t magnitude)
+        {
+            if (magnitude < exact) return static_cast<int>(magnitude);
+            int shift = std::bit_width(magnitude) - 8;
+            return exact + (shift - 1) * exact / 2 +
+                   static_cast<int>(magnitude >> shift) - exact / 2;
+        }
+
+        // Middle magnitude of a bucket
+        static std::int64_t magnitude_of(int bucket)
+        {
+            if (bucket < exact) return bucket;
+            int shift = (bucket - exact) / (exact / 2) + 1;
+            std::int64_t top = (bucket - exact) % (exact / 2) + exact / 2;
+            return (top << shift) + ((std::int64_t{1} << shift) - 1) / 2;
+        }
+
+        void add(int value)
+        {
+            auto magnitude = value < 0
+                                 ? 0u - static_cast<std::uint32_t>(value)
+                                 : static_cast<std::uint32_t>(value);
+            auto bucket = magnitude_bucket(magnitude);
+            ++counts[value < 0 ? per_sign - 1 - bucket : per_sign + bucket];
+        }
+
+        void merge(const ValueHistogram& other)
+        {
+            for (std::size_t i = 0; i < counts.size(); ++i) {
+                counts[i] += other.counts[i];
+            }
+        }
+
+        // Value standing for the rank-th smallest one added, from 1
+        int value_at(std::size_t rank) const
+        {
+            std::size_t seen = 0;
+            for (int i = 0; i < 2 * per_sign; ++i) {
+                seen += counts[i];
+                if (seen < rank) continue;
+                auto value = i < per_sign ? -magnitude_of(per_sign - 1 - i)
+                                          : magnitude_of(i - per_sign);
+                return static_cast<int>(std::clamp<std::int64_t>(
+                    value, std::numeric_limits<int>::min(),
+                    std::numeric_limits<int>::max()));
+            }
+            return 0;
+        }
+    };
+
+    // Evenly spaced inputs goal_seek tries when its range ends do not
+    // bracket the target
+    static constexpr int goal_seek_probes = 64;
+
+    // Rows buffered between pipeline stages
+    static constexpr std::size_t pipeline_queue_size = 1024;
+
+    unsigned thread_count = 1;
+
+    // Rows kept behind the last printed row in pipelined mode. Zero keeps
+    // the whole sheet
+    int stream_window = 0;
+
+    // Sweeps over a cycle in iterative calculation, zero when cycles are
+    // errors, and the largest change of a cell at which a cycle has
+    // settled
+    int iteration_limit = 0;
+    int iteration_tolerance = 0;
+
+    // Accounted bytes a load may add before it fails, zero for no limit
+    std::size_t memory_budget = 0;
+
+    // Spreadsheet dimensions
+    int max_col = 0;
+    int max_row = 0;
+
+    // Counters of the memory this sheet's structures hold. A snapshot
+    // made by clone() shares the account of the sheet it came from
+    std::shared_ptr<MemoryAccount> account = std::make_shared<MemoryAccount>();
+
+    // Store cells
+    Cells cells{*account};
+
+    // Store dependencies. Maps to {formula, deps[]} pair
+    // NB: We are storing downstream dependencies
+    // i.e: if A0 -> A1, this means A1's formula contains A0
+    Dependencies dependencies{*account};
+
+    // Compiled formula of each formula cell
+    Programs programs{*account};
+
+    // Caller-owned columns of numbers, read in place. Cells in cells take
+    // precedence over them
+    std::vector<std::span<const int>> adopted;
+
+    // Sheet this one was cloned from, shared with other clones and never
+    // modified. Cells here override its cells. Dependencies and programs
+    // stay empty while set, and are read from the last sheet down the
+    // chain
+    std::shared_ptr<const Spreadsheet> base;
+
+    // Formulas of the structure that set_value replaced with numbers in
+    // this sheet. Their programs and the edges into them are skipped, and
+    // detach() drops them for good
+    std::unordered_set<std::string> cleared;
+
+    // Cells written by set_value since the last recalculation
+    std::vector<std::string> changed;
+
+    // Index answering dependents_of and precedents_of. Shared with clones
+    // until either changes its formulas
+    std::shared_ptr<const Reachability> reachability;
+
+    // Built by the first insert or delete and kept up to date by the
+    // ones after it. Other changes to the formulas drop it
+    std::unique_ptr<Placement> placement;
+
+    explicit Spreadsheet(std::shared_ptr<MemoryAccount> shared)
+        : account(std::move(shared))
+    {
+    }
+
+    bool contains_letter(const std::string&) const;
+    void calculate_postfix(std::pair<int, int>, const std::string&);
+    Program compile_formula(const std::string&);
+    CellValue evaluate_program(const Program&, const Operand*);
+    void prefetch_operands(const Step&, std::span<const Operand>);
+    void parse_tokens(std::pair<int, int>, const std::string&);
+    void shift_cells(bool, int, int);
+    std::string rewrite_formula(std::string_view, const Program&);
+    void begin_load();
+    int parse_rows(const std::string&);
+    InputCounts count_input(const std::string&) const;
+    void reserve_input(const InputCounts&);
+    int parse_input_parallel(const std::string&);
+    bool over_budget(std::size_t = 0) const;
+    bool evaluation_over_budget() const;
+    std::size_t stored_bytes(const InputCounts&, std::size_t,
+                             std::size_t) const;
+    std::size_t input_bytes(const InputCounts&) const;
+    std::size_t evaluation_bytes(std::size_t, std::size_t) const;
+    void append_header(std::string&);
+    void append_row(std::string&, int, int);
+    std::size_t row_size(int, int);
+    void parse_tokens(std::pair<int, int>, const std::string&, ParseBuffer&);
+    void resolve_dependencies(RowProgress* = nullptr);
+    Plan build_plan(const DependencyGraph::Addresses&);
+    void evaluate_step(const Plan&, std::size_t);
+    void evaluate_iterative(const DependencyGraph&, const Plan&,
+                            const GraphOrder&);
+    void evaluate_parallel(const DependencyGraph&, const Plan&,
+                           const std::vector<char>&, RowProgress*);
+    void track_rows(RowProgress&, const DependencyGraph&,
+                    const std::vector<char>&);
+    void emit_completed_rows(RowProgress&);
+    template <typename Body>
+    void parallel_for(std::size_t, Body);
+    std::vector<std::vector<int>> assign_levels(std::span<const int>,
+                                                std::span<const int>,
+                                                const std::vector<char>&);
+    DependencyGraph build_graph(
+        const std::unordered_set<std::string>* = nullptr) const;
+    int formula_cost(const Program&) const;
+    std::vector<Task> contract_chains(const DependencyGraph&);
+    GraphOrder topological_sort_dependencies(const DependencyGraph&) const;
+    GraphOrder analyse_graph_parallel(const DependencyGraph&);
+    bool has_self_reference(const DependencyGraph&, int) const;
+    int col_to_coord(const std::string&) const;
+    std::string coord_to_col(int) const;
+    std::string coords_to_address(const std::pair<int, int>&) const;
+    std::optional<std::pair<int, int>> parse_address(std::string_view) const;
+    std::pair<int, int> address_to_coords(const std::string&) const;
+    bool is_letter_number_format(const std::string&) const;
+    void print_dependencies();
+    bool is_empty(const CellValue& cell);
+    bool is_error(const CellValue& cell) const;
+    const int* adopted_number(int, int) const;
+    Operand lookup(int, int) const;
+    bool has_column(int) const;
+    void detach();
+    void drop_formula(const std::string&);
+    const Spreadsheet& structure() const;
+    bool is_formula(const std::string&) const;
+    Plan build_cone_plan(const std::vector<std::string>&);
+    std::vector<std::string> downstream_order(const std::vector<std::string>&,
+                                              bool* = nullptr) const;
+    ScenarioPlan plan_scenarios(const std::vector<std::string>&,
+                                const std::vector<std::string>&);
+    void run_scenarios(const ScenarioPlan&, ScenarioBlock&, std::size_t);
+    const int* number_at(const std::string&) const;
+    std::shared_ptr<const Reachability> build_reachability() const;
+    std::unique_ptr<Placement> build_placement() const;
+    std::vector<std::string> reachable(const std::string&, bool);
+};
+
+// Returns false if the load would take the accounted structures past the
+// memory budget: either while reading, or because the graph and plan
+// needed to evaluate what was read would. The sheet is then left empty
+bool Spreadsheet::parse_input(std::string file_name)
+{
+    begin_load();
+    int rows = parse_rows(file_name);
+    if (rows >= 0 && evaluation_over_budget()) rows = -1;
+    if (rows < 0) {
+        clear();
+        return false;
+    }
+    resolve_dependencies();
+    max_row = rows - 1;
+    return true;
+}
+
+// Loads the file like parse_input but leaves formulas unevaluated and
+// reports on the graph instead. recalculate() evaluates them later. Over
+// the memory budget, the sheet is left empty and so is the report
+Spreadsheet::GraphReport Spreadsheet::analyse_input(std::string file_name)
+{
+    begin_load();
+    int rows = parse_rows(file_name);
+    if (rows < 0) {
+        clear();
+        return {};
+    }
+    max_row = rows - 1;
+    return graph_report();
+}
+
+// Reads the file the way parse_input does, splitting cells and formula
+// tokens alike, but only counts what it would store. The sheet is left
+// untouched. Every formula and every cell a formula reads gets a
+// dependencies entry, so the cells read are tracked by coordinates along
+// with how many references each has, which sizes its dependent list
+Spreadsheet::SheetProfile Spreadsheet::profile_input(
+    std::string file_name) const
+{
+    SheetProfile profile;
+    std::size_t text_bytes = 0;  // formula text too long to sit inline
+    auto inline_capacity = std::string().capacity();
+    auto key = [](std::pair<int, int> coords) {
+        return std::uint64_t{static_cast<std::uint32_t>(coords.first)} << 32 |
+               static_cast<std::uint32_t>(coords.second);
+    };
+    std::unordered_map<std::uint64_t, std::size_t> entries;  // to dependents
+    std::ifstream file(file_name);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::stringstream ss(line);
+        std::string cell;
+        int col = 0;
+        while (std::getline(ss, cell, ',')) {
+            ++col;
+            if (!contains_letter(cell)) {
+                ++profile.literal_cells;
+                continue;
+            }
+            ++profile.formula_cells;
+            entries.try_emplace(
+                key({col - 1, static_cast<int>(profile.rows)}), 0);
+            if (cell.size() > inline_capacity) text_bytes += cell.size() + 1;
+            std::istringstream iss(cell);
+            std::string token;
+            while (iss >> token) {
+                ++profile.formula_tokens;
+                if (is_letter_number_format(token)) {
+                    ++profile.references;
+                    ++entries[key(address_to_coords(token))];
+                }
+            }
+        }
+        profile.columns =
+            std::max(profile.columns, static_cast<std::size_t>(col));
+        ++profile.rows;
+    }
+    profile.referenced_cells = entries.size() - profile.formula_cells;
+
+    InputCounts counts;
+    counts.column_cells.resize(profile.columns);
+    counts.cells = profile.literal_cells + profile.formula_cells;
+    counts.formula_cells = profile.formula_cells;
+    counts.formula_tokens = profile.formula_tokens;
+    counts.text_bytes = text_bytes;
+    auto& bytes = profile.estimated_bytes;
+    bytes = stored_bytes(counts, entries.size(), heap_block);
+
+    // Dependent lists grow by push_back, doubling their capacity
+    for (const auto& [cell, dependents] : entries) {
+        if (dependents == 0) continue;
+        bytes += heap_block + std::bit_ceil(dependents) * sizeof(std::string);
+    }
+
+    bytes += evaluation_bytes(entries.size(), profile.references);
+    return profile;
+}
+
+// Estimated size of the cells, formulas and programs counts describes,
+// and of the dependencies entries of the formulas and the cells they
+// read, without their dependent lists. Hash map nodes hold a next
+// pointer, and the hash for string keys, and take a bucket slot each.
+// Every node and program adds block bytes for the heap
+std::size_t Spreadsheet::stored_bytes(const InputCounts& counts,
+                                      std::size_t entries,
+                                      std::size_t block) const
+{
+    constexpr std::size_t node = 2 * sizeof(void*);
+    constexpr std::size_t keyed_node = node + sizeof(std::size_t);
+    return counts.cells *
+               (block + node + sizeof(std::pair<const int, CellValue>)) +
+           counts.column_cells.size() *
+               (block + node + sizeof(std::pair<const int, Column>)) +
+           entries * (block + keyed_node + sizeof(Dependencies::value_type)) +
+           counts.formula_cells *
+               (2 * block + keyed_node +
+                sizeof(std::pair<const std::string, Program>)) +
+           counts.formula_tokens * sizeof(Op) + counts.text_bytes;
+}
+
+// Accounted bytes a load of what counts describes needs at least, with
+// the evaluation that follows it. The allocators count what is asked of
+// them, with no heap overhead. Only formulas are taken to have entries,
+// each reference adding one dependent, so a load over this estimate
+// cannot fit and the checks while parsing catch the rest
+std::size_t Spreadsheet::input_bytes(const InputCounts& counts) const
+{
+    return stored_bytes(counts, counts.formula_cells, 0) +
+           counts.references * sizeof(std::string) +
+           evaluation_bytes(counts.formula_cells, counts.references);
+}
+
+// Estimated size of the graph and plan built to evaluate a graph of
+// cells with edges between them
+std::size_t Spreadsheet::evaluation_bytes(std::size_t cells,
+                                          std::size_t edges) const
+{
+    constexpr std::size_t keyed_node = 3 * sizeof(void*);
+    return cells * (sizeof(std::string) + keyed_node +
+                    sizeof(std::pair<const std::string, int>) +
+                    sizeof(const Program*) + sizeof(Step) + 4 * sizeof(int)) +
+           edges * (sizeof(int) + sizeof(Operand));
+}
+
+// Detaches the sheet for a load and counts the bytes it allocates from
+// here on against the memory budget
+void Spreadsheet::begin_load()
+{
+    detach();
+    account->load_bytes.store(0, std::memory_order_relaxed);
+}
+
+// Whether the bytes the current load allocated, plus more still to come,
+// are past the memory budget. Net frees count as nothing
+bool Spreadsheet::over_budget(std::size_t more) const
+{
+    if (memory_budget == 0) return false;
+    auto bytes = std::max<std::ptrdiff_t>(
+        account->load_bytes.load(std::memory_order_relaxed), 0);
+    return static_cast<std::size_t>(bytes) + more > memory_budget;
+}
+
+// Whether the graph and plan that evaluating the loaded formulas builds
+// would take the load past the memory budget
+bool Spreadsheet::evaluation_over_budget() const
+{
+    if (memory_budget == 0) return false;
+    std::size_t edges = 0;
+    for (const auto& [address, entry] : dependencies) {
+        edges += entry.second.size();
+    }
+    return over_budget(evaluation_bytes(dependencies.size(), edges));
+}
+
+// Report on the graph of the loaded formulas. Cycle members are left out
+// as they are never evaluated
+Spreadsheet::GraphReport Spreadsheet::graph_report() const
+{
+    const auto& owner = structure();
+    auto graph = owner.build_graph(&cleared);
+    auto sorted = owner.topological_sort_dependencies(graph);
+    std::size_t n = graph.addresses.size();
+
+    GraphReport report;
+    report.cells = n;
+    std::vector<int> level(n, 0);
+    std::vector<std::int64_t> start(n, 0);  // cost finished before a cell
+    std::vector<std::int64_t> finish(n, 0);
+    std::vector<int> critical(n, -1);  // precedent finishing last
+    int last = -1;
+    for (int v : sorted.order) {
+        if (sorted.on_cycle[v]) {
+            ++report.cycle_cells;
+            continue;
+        }
+        finish[v] = start[v];
+        int next_level = level[v];
+        if (graph.programs[v] != nullptr) {
+            auto cost = formula_cost(*graph.programs[v]);
+            ++report.formulas;
+            report.total_cost += cost;
+            finish[v] += cost;
+            auto index = static_cast<std::size_t>(level[v]);
+            if (report.level_widths.size() <= index) {
+                report.level_widths.resize(index + 1);
+            }
+            ++report.level_widths[index];
+            ++next_level;
+            if (last == -1 || finish[v] > finish[last]) last = v;
+        }
+        for (int e = graph.edge_offsets[v]; e < graph.edge_offsets[v + 1];
+             ++e) {
+            int w = graph.edges[e];
+            level[w] = std::max(level[w], next_level);
+            if (critical[w] == -1 || finish[v] > start[w]) {
+                start[w] = std::max(start[w], finish[v]);
+                critical[w] = v;
+            }
+        }
+    }
+
+    if (last != -1) {
+        report.critical_path_cost = finish[last];
+        for (int v = last; v != -1; v = critical[v]) {
+            if (graph.programs[v] != nullptr) {
+                report.critical_path.push_back(graph.addresses[v]);
+            }
+        }
+        std::reverse(report.critical_path.begin(), report.critical_path.end());
+    }
+    if (report.critical_path_cost > 0) {
+        report.max_speedup = static_cast<double>(report.total_cost) /
+                             static_cast<double>(report.critical_path_cost);
+    }
+    return report;
+}
+
+void Spreadsheet::print_report(const GraphReport& report,
+                               std::ostream& out) const
+{
+    out << "cells: " << report.cells << '\n';
+    out << "formulas: " << report.formulas << '\n';
+    out << "cells on cycles: " << report.cycle_cells << '\n';
+    out << "depth: " << report.level_widths.size() << '\n';
+    out << "level widths:";
+    for (auto width : report.level_widths) out << ' ' << width;
+    out << '\n';
+    out << "total cost: " << report.total_cost << '\n';
+    out << "critical path cost: " << report.critical_path_cost << '\n';
+    out << "critical path:";
+    for (const auto& address : report.critical_path) out << ' ' << address;
+    out << '\n';
+    out << "max speedup: " << report.max_speedup << '\n';
+}
+
+// Adopts caller-owned columns without copying them: values[c][r] is the
+// number in column c, row r. Non-empty strings in formulas[c][r] are
+// parsed like file cells and take the place of the number. The arrays
+// must outlive the sheet or the next clear(). Returns false, leaving the
+// sheet empty, if the formulas or evaluating them would go past the
+// memory budget; the numbers themselves are not the sheet's to count
+bool Spreadsheet::import_columns(
+    std::vector<std::span<const int>> values,
+    std::vector<std::span<const std::string>> formulas)
+{
+    begin_load();
+    int rows = 0;
+    for (const auto& column : values) {
+        rows = std::max(rows, static_cast<int>(column.size()));
+    }
+    for (int col = 0; col < static_cast<int>(formulas.size()); ++col) {
+        rows = std::max(rows, static_cast<int>(formulas[col].size()));
+        for (int row = 0; row < static_cast<int>(formulas[col].size());
+             ++row) {
+            if (formulas[col][row].empty()) continue;
+            parse_tokens({col, row}, formulas[col][row]);
+            if (over_budget()) {
+                clear();
+                return false;
+            }
+        }
+    }
+    if (evaluation_over_budget()) {
+        clear();
+        return false;
+    }
+    adopted = std::move(values);
+    int cols = static_cast<int>(std::max(adopted.size(), formulas.size()));
+    max_col = std::max(max_col, cols - 1);
+    resolve_dependencies();
+    max_row = rows - 1;
+    return true;
+}
+
+// Fills rows first_row to last_row of a column with one formula.
+// References written A{r}, A{r-1} or A{r+1} are relative to the row being
+// filled and other tokens read as in the file. The formula is compiled
+// once and each cell gets a copy with its references shifted, so no cell
+// text is parsed. References above row 0 are errors. Formulas already in
+// the range are replaced, edges included. The filled cells are evaluated
+// by the next recalculate(). False if the column is not a column name
+// whose number fits in an int, or the range starts above row 0, leaving
+// the sheet as it was.
+//
+// Each cell still gets its address and formula text written out: the
+// graph is keyed by address, and shift_cells and print_dependencies read
+// the text. Both are built by appending the pattern's tokens, with no
+// parsing
+bool Spreadsheet::fill_formula(const std::string& column, int first_row,
+                               int last_row, const std::string& formula)
+{
+    static const std::regex column_pattern("^[A-Z]+$");
+    static const std::regex relative_pattern("^([A-Z]+)\\{r([+-][0-9]+)?\\}$");
+    if (!std::regex_match(column, column_pattern) || first_row < 0 ||
+        !parse_address(column + "0")) {
+        return false;
+    }
+    detach();
+
+    // Each token compiles to one op. Relative references keep their row
+    // offset in the op until filled. Offsets and columns that do not fit
+    // in an int leave the token to compile as an error
+    struct Token {
+        std::string text;
+        bool relative = false;
+    };
+    Program pattern(*account);
+    std::vector<Token> tokens;
+    std::istringstream iss(formula);
+    std::string text;
+    std::smatch match;
+    auto offset_of = [](const std::string& digits) -> std::optional<int> {
+        int offset = 0;
+        auto [end, error] = std::from_chars(
+            digits.data() + 1, digits.data() + digits.size(), offset);
+        if (error != std::errc()) return std::nullopt;
+        return digits[0] == '-' ? -offset : offset;
+    };
+    while (iss >> text) {
+        std::optional<int> offset = 0;
+        if (std::regex_match(text, match, relative_pattern) &&
+            parse_address(match[1].str() + "0") &&
+            (!match[2].matched || (offset = offset_of(match[2])))) {
+            Op op;
+            op.kind = Op::Kind::Reference;
+            op.coords = {col_to_coord(match[1]), *offset};
+            pattern.push_back(op);
+            tokens.push_back({match[1], true});
+        }
+        else {
+            pattern.push_back(compile_formula(text).front());
+            tokens.push_back({text, false});
+        }
+    }
+
+    int col = col_to_coord(column);
+    auto count =
+        static_cast<std::size_t>(std::max(last_row - first_row + 1, 0));
+    dependencies.reserve(dependencies.size() + count);
+    programs.reserve(programs.size() + count);
+    for (int row = first_row; row <= last_row; ++row) {
+        auto cell_address = column + std::to_string(row);
+        auto old = programs.find(cell_address);
+        if (old != programs.end()) {
+            for (const auto& op : old->second) {
+                if (op.kind == Op::Kind::Reference) {
+                    std::erase(
+                        dependencies[coords_to_address(op.coords)].second,
+                        cell_address);
+                }
+            }
+        }
+
+        auto program = pattern;
+        std::string cell_formula;
+        for (std::size_t i = 0; i < program.size(); ++i) {
+            auto& op = program[i];
+            std::string token = tokens[i].text;
+            if (tokens[i].relative) {
+                auto target = std::int64_t{op.coords.second} + row;
+                op.coords.second = static_cast<int>(target);
+                if (target < 0 || target > std::numeric_limits<int>::max()) {
+                    op.kind = Op::Kind::Invalid;
+                    token = "#REF";
+                }
+                else {
+                    token += std::to_string(op.coords.second);
+                }
+            }
+            if (op.kind == Op::Kind::Reference) {
+                dependencies[token].second.push_back(cell_address);
+            }
+            if (!cell_formula.empty()) cell_formula += ' ';
+            cell_formula += token;
+        }
+        dependencies[cell_address].first = std::move(cell_formula);
+        programs[cell_address] = std::move(program);
+    }
+    max_col = std::max(max_col, col);
+    max_row = std::max(max_row, last_row);
+    return true;
+}
+
+// Moves the rows (or columns) from index at onwards by count. A negative
+// count first deletes the -count rows starting at at. Cells move by
+// relinking their map nodes. Only formulas that sit in moved cells or
+// reference them are rewritten, and references to deleted cells become
+// #REF errors. Adopted numbers past the edit are copied into cells, since
+// the caller's arrays cannot move. Values are refreshed by recalculate()
+//
+// The placement finds the graph addresses that move, so only those and
+// the formulas reading them are visited. The first edit after the
+// formulas change builds it. Row edits still visit every cell node in
+// the unordered column maps to relink it
+void Spreadsheet::shift_cells(bool rows, int at, int count)
+{
+    // Kept across detach(), as it is updated below, unless detach()
+    // copies the graph in from a base
+    std::unique_ptr<Placement> kept;
+    if (base == nullptr) kept = std::move(placement);
+    detach();
+    placement = kept != nullptr ? std::move(kept) : build_placement();
+    // Moves coords to where the cell goes. False if it is deleted
+    auto shift = [&](std::pair<int, int>& coords) {
+        int& index = rows ? coords.second : coords.first;
+        if (index < at) return true;
+        if (count < 0 && index < at - count) return false;
+        index += count;
+        return true;
+    };
+
+    // Addresses in the graph that move or go, and the formulas that read
+    // them
+    struct Move {
+        std::string from;
+        std::string to;  // empty if deleted
+    };
+    std::vector<Move> moves;
+    std::vector<std::string> affected;
+    std::vector<std::pair<int, int>> moved;
+    auto& along = rows ? placement->rows : placement->columns;
+    auto& across = rows ? placement->columns : placement->rows;
+    for (auto it = along.lower_bound(at); it != along.end(); ++it) {
+        for (int other : it->second) {
+            moved.push_back(rows ? std::pair{other, it->first}
+                                 : std::pair{it->first, other});
+        }
+    }
+    for (auto coords : moved) {
+        auto address = coords_to_address(coords);
+        const auto& entry = dependencies.find(address)->second;
+        moves.push_back(
+            {address, shift(coords) ? coords_to_address(coords) : ""});
+        if (programs.contains(address)) affected.push_back(address);
+        affected.insert(affected.end(), entry.second.begin(),
+                        entry.second.end());
+    }
+    std::sort(affected.begin(), affected.end());
+    affected.erase(std::unique(affected.begin(), affected.end()),
+                   affected.end());
+
+    // Point affected formulas at the new addresses, and the dependent
+    // lists of their precedents at the formulas' new addresses
+    for (const auto& address : affected) {
+        auto program_it = programs.find(address);
+        if (program_it == programs.end()) continue;
+        auto coords = address_to_coords(address);
+        bool kept = shift(coords);
+        auto new_address = kept ? coords_to_address(coords) : "";
+        for (auto& op : program_it->second) {
+            if (op.kind != Op::Kind::Reference) continue;
+            auto& dependents =
+                dependencies[coords_to_address(op.coords)].second;
+            if (!kept) {
+                std::erase(dependents, address);
+            }
+            else if (new_address != address) {
+                std::replace(dependents.begin(), dependents.end(), address,
+                             new_address);
+            }
+            if (!shift(op.coords)) op.kind = Op::Kind::Invalid;
+        }
+        if (kept) {
+            auto& text = dependencies[address].first;
+            text = rewrite_formula(text, program_it->second);
+        }
+    }
+
+    // Rekey moved entries. All nodes are taken out before any goes back so
+    // a new key never meets an old one
+    std::vector<decltype(dependencies)::node_type> dependency_nodes;
+    std::vector<decltype(programs)::node_type> program_nodes;
+    for (const auto& move : moves) {
+        auto dependency_node = dependencies.extract(move.from);
+        auto program_node = programs.extract(move.from);
+        if (move.to.empty()) continue;
+        dependency_node.key() = move.to;
+        dependency_nodes.push_back(std::move(dependency_node));
+        if (!program_node.empty()) {
+            program_node.key() = move.to;
+            program_nodes.push_back(std::move(program_node));
+        }
+    }
+    for (auto& node : dependency_nodes) dependencies.insert(std::move(node));
+    for (auto& node : program_nodes) programs.insert(std::move(node));
+
+    // The placement follows them
+    std::vector<std::decay_t<decltype(along)>::node_type> lines;
+    for (auto it = along.lower_bound(at); it != along.end();) {
+        auto line = along.extract(it++);
+        if (count > 0 || line.key() >= at - count) {
+            line.key() += count;
+            lines.push_back(std::move(line));
+        }
+    }
+    for (auto& line : lines) along.insert(std::move(line));
+    std::vector<int> crossed;
+    for (auto coords : moved) {
+        crossed.push_back(rows ? coords.first : coords.second);
+    }
+    std::sort(crossed.begin(), crossed.end());
+    crossed.erase(std::unique(crossed.begin(), crossed.end()), crossed.end());
+    for (int key : crossed) {
+        auto line = across.find(key);
+        auto& indices = line->second;
+        auto first = std::lower_bound(indices.begin(), indices.end(), at);
+        if (count < 0) {
+            first = indices.erase(
+                first, std::lower_bound(first, indices.end(), at - count));
+        }
+        for (auto it = first; it != indices.end(); ++it) *it += count;
+        if (indices.empty()) across.erase(line);
+    }
+
+    // Cells, then adopted numbers past the edit
+    auto relink = [&](auto& map) {
+        std::vector<typename std::decay_t<decltype(map)>::node_type> nodes;
+        for (auto it = map.begin(); it != map.end();) {
+            auto index = it->first;
+            auto next = std::next(it);
+            if (index >= at) {
+                auto node = map.extract(it);
+                if (count > 0 || index >= at - count) {
+                    node.key() = index + count;
+                    nodes.push_back(std::move(node));
+                }
+            }
+            it = next;
+        }
+        for (auto& node : nodes) map.insert(std::move(node));
+    };
+    if (rows) {
+        for (auto& [col, column] : cells) relink(column);
+        for (int col = 0; col < static_cast<int>(adopted.size()); ++col) {
+            auto& numbers = adopted[col];
+            for (int row = at; row < static_cast<int>(numbers.size());
+                 ++row) {
+                std::pair<int, int> coords{col, row};
+                if (shift(coords)) {
+                    cells[col].try_emplace(coords.second, numbers[row]);
+                }
+            }
+            if (at < static_cast<int>(numbers.size())) {
+                numbers = numbers.first(std::max(at, 0));
+            }
+        }
+    }
+    else {
+        relink(cells);
+        if (at < static_cast<int>(adopted.size())) {
+            if (count > 0) {
+                adopted.insert(adopted.begin() + at, count, {});
+            }
+            else {
+                adopted.erase(adopted.begin() + at,
+                              adopted.begin() +
+                                  std::min<int>(at - count, adopted.size()));
+            }
+        }
+    }
+
+    int& last = rows ? max_row : max_col;
+    if (at <= last) last = std::max(last + count, at - 1);
+}
+
+// Formula text with every Reference token replaced by the address its op
+// now holds, and references turned Invalid by a deletion replaced by
+// #REF. Other tokens are kept as written
+std::string Spreadsheet::rewrite_formula(std::string_view text,
+                                         const Program& program)
+{
+    std::istringstream iss{std::string(text)};
+    std::string token;
+    std::string result;
+    for (const auto& op : program) {
+        if (!(iss >> token)) break;
+        if (!result.empty()) result += ' ';
+        if (op.kind == Op::Kind::Reference) {
+            result += coords_to_address(op.coords);
+        }
+        else if (op.kind == Op::Kind::Invalid &&
+                 is_letter_number_format(token)) {
+            result += "#REF";
+        }
+        else {
+            result += token;
+        }
+    }
+    return result;
+}
+
+// Returns a sheet that shares this one's cells, formulas and graph
+// instead of copying them. The shared state is frozen: values written to
+// either sheet afterwards stay in that sheet, and a structural edit first
+// gives the edited sheet its own copy. The first clone moves this sheet's
+// state into the shared snapshot, so clone() must not run while another
+// thread uses this sheet. The clones it returns can be used on different
+// threads
+Spreadsheet Spreadsheet::clone()
+{
+    if (base == nullptr || !cells.empty()) {
+        // Counting into this sheet's account lets the state move over
+        // without copying
+        std::shared_ptr<Spreadsheet> snapshot(new Spreadsheet(account));
+        snapshot->cells = std::move(cells);
+        snapshot->dependencies = std::move(dependencies);
+        snapshot->programs = std::move(programs);
+        snapshot->adopted = std::move(adopted);
+        snapshot->base = std::move(base);
+        snapshot->max_col = max_col;
+        snapshot->max_row = max_row;
+        cells.clear();
+        dependencies.clear();
+        programs.clear();
+        adopted.clear();
+        placement.reset();
+        base = std::move(snapshot);
+    }
+    Spreadsheet copy;
+    copy.thread_count = thread_count;
+    copy.stream_window = stream_window;
+    copy.iteration_limit = iteration_limit;
+    copy.iteration_tolerance = iteration_tolerance;
+    copy.max_col = max_col;
+    copy.max_row = max_row;
+    copy.base = base;
+    copy.cleared = cleared;
+    copy.changed = changed;
+    copy.reachability = reachability;
+    return copy;
+}
+
+// Gives the sheet its own copy of the state shared with clones. Callers
+// go on to change formulas, so the reachability index and the placement
+// are dropped
+void Spreadsheet::detach()
+{
+    reachability.reset();
+    placement.reset();
+    if (base == nullptr) return;
+    std::vector<const Spreadsheet*> layers;
+    for (auto sheet = base.get(); sheet != nullptr; sheet = sheet->base.get()) {
+        layers.insert(layers.begin(), sheet);
+    }
+    auto overlay = std::move(cells);
+    cells = layers.front()->cells;
+    dependencies = layers.front()->dependencies;
+    programs = layers.front()->programs;
+    adopted = layers.front()->adopted;
+    for (std::size_t i = 1; i < layers.size(); ++i) {
+        for (const auto& [col, column] : layers[i]->cells) {
+            for (const auto& [row, value] : column) cells[col][row] = value;
+        }
+    }
+    for (auto& [col, column] : overlay) {
+        for (auto& [row, value] : column) cells[col][row] = value;
+    }
+    base.reset();
+    for (const auto& address : cleared) drop_formula(address);
+    cleared.clear();
+}
+
+std::unique_ptr<Spreadsheet::Placement> Spreadsheet::build_placement() const
+{
+    std::vector<std::pair<int, int>> addresses;
+    addresses.reserve(dependencies.size());
+    for (const auto& [address, entry] : dependencies) {
+        auto [col, row] = address_to_coords(address);
+        addresses.emplace_back(row, col);
+    }
+    // Filled in order, so every line goes in at the end
+    auto fill = [&](std::map<int, std::vector<int>>& lines) {
+        std::sort(addresses.begin(), addresses.end());
+        for (auto [line, index] : addresses) {
+            if (lines.empty() || lines.rbegin()->first != line) {
+                lines.emplace_hint(lines.end(), line, std::vector<int>{});
+            }
+            lines.rbegin()->second.push_back(index);
+        }
+    };
+    auto index = std::make_unique<Placement>();
+    fill(index->rows);
+    for (auto& [row, col] : addresses) std::swap(row, col);
+    fill(index->columns);
+    return index;
+}
+
+// Removes the formula in a cell of this sheet along with its edges
+void Spreadsheet::drop_formula(const std::string& address)
+{
+    for (const auto& op : programs[address]) {
+        if (op.kind == Op::Kind::Reference) {
+            std::erase(dependencies[coords_to_address(op.coords)].second,
+                       address);
+        }
+    }
+    programs.erase(address);
+    dependencies[address].first.clear();
+}
+
+// The sheet holding dependencies and programs: the first one cloned
+const Spreadsheet& Spreadsheet::structure() const
+{
+    auto sheet = this;
+    while (sheet->base != nullptr) sheet = sheet->base.get();
+    return *sheet;
+}
+
+// Whether the cell holds a formula as seen from this sheet
+bool Spreadsheet::is_formula(const std::string& address) const
+{
+    return structure().programs.contains(address) &&
+           !cleared.contains(address);
+}
+
+// Sets a cell to a number. A formula in the cell is dropped along with
+// its edges; a clone only marks it cleared, leaving the shared structure
+// untouched. Formulas reading the cell are updated by recalculate().
+// Addresses parse_address rejects are ignored
+void Spreadsheet::set_value(const std::string& address, int value)
+{
+    auto coords = parse_address(address);
+    if (!coords) return;
+    if (is_formula(address)) {
+        reachability.reset();
+        if (base != nullptr) {
+            cleared.insert(address);
+        }
+        else {
+            drop_formula(address);
+        }
+    }
+    cells[coords->first][coords->second] = value;
+    max_col = std::max(max_col, coords->first);
+    max_row = std::max(max_row, coords->second);
+    changed.push_back(address);
+}
+
+// Clones only re-evaluate the formulas downstream of the cells set_value
+// changed. Other sheets are evaluated in full
+void Spreadsheet::recalculate()
+{
+    bool complete = true;
+    auto order = base != nullptr ? downstream_order(changed, &complete)
+                                 : std::vector<std::string>{};
+
+    // Cycles downstream of the changes are only solved by a full pass
+    if (iteration_limit > 0 && !complete) detach();
+    if (base != nullptr) {
+        auto plan = build_cone_plan(order);
+        for (std::size_t i = 0; i < plan.steps.size(); ++i) {
+            evaluate_step(plan, i);
+        }
+    }
+    else {
+        resolve_dependencies();
+    }
+    changed.clear();
+}
+
+// Plan evaluating the formulas at the given addresses in order, with
+// formulas read from the structure. Their cells are created in this
+// sheet first, so operands read this sheet's results and not the base's
+Spreadsheet::Plan Spreadsheet::build_cone_plan(
+    const std::vector<std::string>& order)
+{
+    const auto& owner = structure();
+    Plan plan(*account);
+    for (const auto& address : order) {
+        auto program_it = owner.programs.find(address);
+        if (program_it == owner.programs.end() || cleared.contains(address)) {
+            continue;
+        }
+        auto coords = address_to_coords(address);
+        auto& cell = cells[coords.first]
+                         .try_emplace(coords.second, CellState::Empty)
+                         .first->second;
+        plan.steps.push_back({&cell, &program_it->second, 0, 0});
+    }
+    for (auto& step : plan.steps) {
+        step.first_operand = plan.operands.size();
+        for (const auto& op : *step.program) {
+            if (op.kind == Op::Kind::Reference) {
+                plan.operands.push_back(
+                    lookup(op.coords.first, op.coords.second));
+            }
+        }
+        step.operand_count = plan.operands.size() - step.first_operand;
+    }
+    return plan;
+}
+
+// Sets input to the number in [low, high] that makes output equal target
+// and returns true, or to the one bringing output closest and returns
+// false. The formulas downstream of input are planned once, so each trial
+// only re-evaluates them. Bisection on a bracket where output crosses
+// target, with every other step taken by the secant instead, keeps the
+// trials logarithmic while converging faster on smooth formulas. False
+// with the sheet untouched if input is not a cell address
+bool Spreadsheet::goal_seek(const std::string& input,
+                            const std::string& output, int target, int low,
+                            int high)
+{
+    if (low > high) std::swap(low, high);
+    if (!parse_address(input)) return false;
+    bool was_formula = is_formula(input);
+    set_value(input, low);
+    if (was_formula) recalculate();
+    changed.clear();
+
+    // Cycles downstream of input need a full pass per trial when they are
+    // iterated
+    bool complete = true;
+    auto order = downstream_order({input}, &complete);
+    bool full = iteration_limit > 0 && !complete;
+    if (full) detach();
+    auto plan = build_cone_plan(order);
+    auto coords = address_to_coords(input);
+    auto& cell = cells[coords.first][coords.second];
+    auto gap = [&](int x) -> std::optional<std::int64_t> {
+        cell = x;
+        if (full) {
+            resolve_dependencies();
+        }
+        else {
+            for (std::size_t i = 0; i < plan.steps.size(); ++i) {
+                evaluate_step(plan, i);
+            }
+        }
+        const int* number = number_at(output);
+        if (number == nullptr) return std::nullopt;
+        return std::int64_t{*number} - target;
+    };
+
+    // Closest input so far
+    int best = low;
+    auto best_gap = std::numeric_limits<std::int64_t>::max();
+    auto consider = [&](int x, std::optional<std::int64_t> y) {
+        if (y && std::abs(*y) < best_gap) {
+            best = x;
+            best_gap = std::abs(*y);
+        }
+        return y && *y == 0;
+    };
+
+    std::int64_t a = low;
+    std::int64_t b = high;
+    auto gap_a = gap(low);
+    if (consider(low, gap_a)) return true;
+    auto gap_b = gap(high);
+    if (consider(high, gap_b)) return true;
+    auto brackets = [&]() {
+        return gap_a && gap_b && (*gap_a < 0) != (*gap_b < 0);
+    };
+
+    // Without a crossing at the ends, look for one between evenly spaced
+    // points, moving a up until the sign changes
+    for (int k = 1; k < goal_seek_probes && !brackets(); ++k) {
+        auto x = low + (std::int64_t{high} - low) * k / goal_seek_probes;
+        auto gap_x = gap(static_cast<int>(x));
+        if (consider(static_cast<int>(x), gap_x)) return true;
+        if (!gap_x) continue;
+        if (gap_a && (*gap_x < 0) != (*gap_a < 0)) {
+            b = x;
+            gap_b = gap_x;
+        }
+        else {
+            a = x;
+            gap_a = gap_x;
+        }
+    }
+
+    if (brackets()) {
+        for (bool secant = true; b - a > 1; secant = !secant) {
+            auto x = a + (b - a) / 2;
+            if (secant) {
+                auto s = static_cast<std::int64_t>(
+                    std::llround(static_cast<double>(a) -
+                                 static_cast<double>(*gap_a) *
+                                     static_cast<double>(b - a) /
+                                     static_cast<double>(*gap_b - *gap_a)));
+                if (s > a && s < b) x = s;
+            }
+            auto gap_x = gap(static_cast<int>(x));
+            if (consider(static_cast<int>(x), gap_x)) return true;
+            if (!gap_x) break;
+            if ((*gap_x < 0) == (*gap_a < 0)) {
+                a = x;
+                gap_a = gap_x;
+            }
+            else {
+                b = x;
+                gap_b = gap_x;
+            }
+        }
+    }
+    gap(best);
+    return false;
+}
+
+// Evaluates the sheet once per scenario, where scenario i sets each input
+// cell to the i-th number of its vector, and returns the outputs' values
+// per scenario. Blocks of scenarios are spread over thread_count threads.
+// Cells not downstream of an input keep their evaluated value. Inputs
+// should have equal lengths; extra numbers are ignored
+std::vector<Spreadsheet::ScenarioValues> Spreadsheet::evaluate_scenarios(
+    const std::vector<std::pair<std::string, std::vector<int>>>& inputs,
+    const std::vector<std::string>& outputs)
+{
+    std::size_t scenarios = 0;
+    std::vector<std::string> addresses;
+    for (const auto& [address, numbers] : inputs) {
+        scenarios = addresses.empty() ? numbers.size()
+                                      : std::min(scenarios, numbers.size());
+        addresses.push_back(address);
+    }
+    auto plan = plan_scenarios(addresses, outputs);
+
+    std::vector<ScenarioValues> results;
+    for (std::size_t o = 0; o < outputs.size(); ++o) {
+        ScenarioValues result{std::vector<int>(scenarios, 0),
+                              std::vector<char>(scenarios, 0)};
+        if (plan.outputs[o] < 0) {
+            const int* number = number_at(outputs[o]);
+            std::fill(result.values.begin(), result.values.end(),
+                      number != nullptr ? *number : 0);
+            std::fill(result.errors.begin(), result.errors.end(),
+                      number == nullptr);
+        }
+        results.push_back(std::move(result));
+    }
+
+    parallel_for(scenarios, [&](std::size_t first, std::size_t last,
+                                std::size_t) {
+        ScenarioBlock block(plan);
+        for (auto begin = first; begin < last; begin += scenario_block) {
+            auto n = std::min(scenario_block, last - begin);
+            for (std::size_t i = 0; i < inputs.size(); ++i) {
+                auto lane = block.lane(plan.inputs[i]);
+                std::copy_n(inputs[i].second.begin() + begin, n,
+                            block.values.begin() + lane);
+                std::fill_n(block.errors.begin() + lane, n, 0);
+            }
+            run_scenarios(plan, block, n);
+            for (std::size_t o = 0; o < outputs.size(); ++o) {
+                if (plan.outputs[o] < 0) continue;
+                auto lane = block.lane(plan.outputs[o]);
+                std::copy_n(block.values.begin() + lane, n,
+                            results[o].values.begin() + begin);
+                std::copy_n(block.errors.begin() + lane, n,
+                            results[o].errors.begin() + begin);
+            }
+        }
+    });
+    return results;
+}
+
+// Evaluates the sheet for samples draws of the random inputs and returns
+// statistics of each output over the draws. Draw k seeds its own
+// generator from seed and k, so results do not depend on thread_count.
+// Draws run in blocks like evaluate_scenarios, each thread keeping its
+// own statistics, which are merged at the end
+std::vector<Spreadsheet::SampleStats> Spreadsheet::simulate(
+    const std::vector<std::pair<std::string, Distribution>>& inputs,
+    const std::vector<std::string>& outputs, std::size_t samples,
+    std::uint64_t seed, const std::vector<double>& percentiles)
+{
+    std::vector<std::string> addresses;
+    for (const auto& [address, distribution] : inputs) {
+        addresses.push_back(address);
+    }
+    auto plan = plan_scenarios(addresses, outputs);
+
+    // Running count, mean and sum of squared deviations (Welford), and
+    // how often values came up near each bucket
+    struct Accumulator {
+        std::size_t count = 0;
+        std::size_t errors = 0;
+        double mean = 0;
+        double m2 = 0;
+        ValueHistogram histogram;
+
+        void add(int value)
+        {
+            ++count;
+            double delta = value - mean;
+            mean += delta / static_cast<double>(count);
+            m2 += delta * (value - mean);
+            histogram.add(value);
+        }
+
+        void merge(const Accumulator& other)
+        {
+            if (other.count > 0) {
+                auto total = static_cast<double>(count + other.count);
+                double delta = other.mean - mean;
+                m2 += other.m2 + delta * delta *
+                                     static_cast<double>(count) *
+                                     static_cast<double>(other.count) / total;
+                mean += delta * static_cast<double>(other.count) / total;
+                count += other.count;
+            }
+            errors += other.errors;
+            histogram.merge(other.histogram);
+        }
+    };
+    std::vector<std::vector<Accumulator>> partial(
+        thread_count, std::vector<Accumulator>(outputs.size()));
+
+    parallel_for(samples, [&](std::size_t first, std::size_t last,
+                              std::size_t chunk) {
+        auto& accumulators = partial[chunk];
+        ScenarioBlock block(plan);
+        for (auto begin = first; begin < last; begin += scenario_block) {
+            auto n = std::min(scenario_block, last - begin);
+            for (std::size_t k = 0; k < n; ++k) {
+                SplitMix64 random(seed ^ (begin + k) * 0x9e3779b97f4a7c15);
+                for (std::size_t i = 0; i < inputs.size(); ++i) {
+                    auto lane = block.lane(plan.inputs[i]);
+                    block.values[lane + k] = random.draw(inputs[i].second);
+                    block.errors[lane + k] = 0;
+                }
+            }
+            run_scenarios(plan, block, n);
+            for (std::size_t o = 0; o < outputs.size(); ++o) {
+                auto& accumulator = accumulators[o];
+                if (plan.outputs[o] < 0) {
+                    const int* number = number_at(outputs[o]);
+                    for (std::size_t k = 0; k < n; ++k) {
+                        if (number != nullptr) {
+                            accumulator.add(*number);
+                        }
+                        else {
+                            ++accumulator.errors;
+                        }
+                    }
+                    continue;
+                }
+                auto lane = block.lane(plan.outputs[o]);
+                for (std::size_t k = 0; k < n; ++k) {
+                    if (block.errors[lane + k]) {
+                        ++accumulator.errors;
+                    }
+                    else {
+                        accumulator.add(block.values[lane + k]);
+                    }
+                }
+            }
+        }
+    });
+
+    std::vector<SampleStats> results;
+    for (std::size_t o = 0; o < outputs.size(); ++o) {
+        Accumulator total;
+        for (const auto& accumulators : partial) total.merge(accumulators[o]);
+        SampleStats stats;
+        stats.count = total.count;
+        stats.errors = total.errors;
+        stats.mean = total.mean;
+        stats.variance =
+            total.count > 1 ? total.m2 / static_cast<double>(total.count - 1)
+                            : 0;
+
+        // Nearest-rank percentiles over the histogram, exact for values
+        // of magnitude below 256
+        for (double percentile : percentiles) {
+            auto rank = static_cast<std::size_t>(
+                std::ceil(percentile / 100 * static_cast<double>(total.count)));
+            rank = std::clamp<std::size_t>(rank, 1, total.count);
+            stats.percentiles.push_back(total.histogram.value_at(rank));
+        }
+        results.push_back(std::move(stats));
+    }
+    return results;
+}
+
+// Orders the formulas downstream of the inputs once and gives every cell
+// whose value varies a slot: inputs first, then formulas in evaluation
+// order. References to cells that do not vary are folded into numbers,
+// or into Invalid if the cell is not a number. Outputs that do not vary
+// get slot -1
+Spreadsheet::ScenarioPlan Spreadsheet::plan_scenarios(
+    const std::vector<std::string>& inputs,
+    const std::vector<std::string>& outputs)
+{
+    const auto& owner = structure();
+    ScenarioPlan plan;
+    std::unordered_map<std::string, int> slots;
+    for (const auto& address : inputs) {
+        auto slot = slots.try_emplace(address, slots.size()).first->second;
+        plan.inputs.push_back(slot);
+    }
+
+    for (const auto& address : downstream_order(inputs)) {
+        auto program_it = owner.programs.find(address);
+        if (program_it == owner.programs.end() || slots.contains(address) ||
+            cleared.contains(address)) {
+            continue;
+        }
+        ScenarioPlan::Formula formula{program_it->second, 0, true};
+        std::size_t depth = 0;
+        for (auto& op : formula.program) {
+            if (op.kind == Op::Kind::Reference) {
+                auto slot_it = slots.find(coords_to_address(op.coords));
+                if (slot_it != slots.end()) {
+                    op.value = slot_it->second;  // slot read
+                }
+                else if (const int* number = number_at(
+                             coords_to_address(op.coords))) {
+                    op.kind = Op::Kind::Number;
+                    op.value = *number;
+                }
+                else {
+                    op.kind = Op::Kind::Invalid;
+                }
+            }
+            if (op.kind == Op::Kind::Number ||
+                op.kind == Op::Kind::Reference) {
+                plan.max_depth = std::max(plan.max_depth, ++depth);
+            }
+            else if (op.kind == Op::Kind::Invalid || depth < 2) {
+                formula.valid = false;
+            }
+            else {
+                --depth;
+            }
+        }
+        formula.valid = formula.valid && depth == 1;
+        formula.slot = static_cast<int>(slots.size());
+        slots.emplace(address, formula.slot);
+        plan.formulas.push_back(std::move(formula));
+    }
+    plan.slot_count = slots.size();
+
+    for (const auto& address : outputs) {
+        auto slot_it = slots.find(address);
+        plan.outputs.push_back(slot_it != slots.end() ? slot_it->second : -1);
+    }
+    return plan;
+}
+
+// Runs the plan's formulas over the first n scenarios of a block whose
+// input slots are filled. Each op is applied to every scenario in a plain
+// loop over the lanes, which the compiler vectorizes
+void Spreadsheet::run_scenarios(const ScenarioPlan& plan,
+                                ScenarioBlock& block, std::size_t n)
+{
+    auto& values = block.values;
+    auto& errors = block.errors;
+    for (const auto& formula : plan.formulas) {
+        auto out = block.lane(formula.slot);
+        if (!formula.valid) {
+            std::fill_n(errors.begin() + out, n, 1);
+            continue;
+        }
+        auto top = plan.slot_count;
+        for (const auto& op : formula.program) {
+            if (op.kind == Op::Kind::Number) {
+                std::fill_n(values.begin() + block.lane(top), n, op.value);
+                std::fill_n(errors.begin() + block.lane(top), n, 0);
+                ++top;
+                continue;
+            }
+            if (op.kind == Op::Kind::Reference) {
+                std::copy_n(values.begin() + block.lane(op.value), n,
+                            values.begin() + block.lane(top));
+                std::copy_n(errors.begin() + block.lane(op.value), n,
+                            errors.begin() + block.lane(top));
+                ++top;
+                continue;
+            }
+
+            // op1 is the top of the stack and op2 the one below. The result
+            // replaces op2
+            --top;
+            const int* op1 = values.data() + block.lane(top);
+            int* op2 = values.data() + block.lane(top - 1);
+            const char* error1 = errors.data() + block.lane(top);
+            char* error2 = errors.data() + block.lane(top - 1);
+            for (std::size_t i = 0; i < n; ++i) error2[i] |= error1[i];
+            if (op.kind == Op::Kind::Add) {
+                for (std::size_t i = 0; i < n; ++i) op2[i] = op1[i] + op2[i];
+            }
+            else if (op.kind == Op::Kind::Subtract) {
+                for (std::size_t i = 0; i < n; ++i) op2[i] = op1[i] - op2[i];
+            }
+            else if (op.kind == Op::Kind::Multiply) {
+                for (std::size_t i = 0; i < n; ++i) op2[i] = op1[i] * op2[i];
+            }
+            else if (op.kind == Op::Kind::Divide) {
+                for (std::size_t i = 0; i < n; ++i) {
+                    error2[i] |= op2[i] == 0;
+                    op2[i] = op1[i] / (op2[i] == 0 ? 1 : op2[i]);
+                }
+            }
+        }
+        std::copy_n(values.begin() + block.lane(plan.slot_count), n,
+                    values.begin() + out);
+        std::copy_n(errors.begin() + block.lane(plan.slot_count), n,
+                    errors.begin() + out);
+    }
+}
+
+// The cell's number, or nullptr if it holds none
+const int* Spreadsheet::number_at(const std::string& address) const
+{
+    auto coords = address_to_coords(address);
+    auto operand = lookup(coords.first, coords.second);
+    if (operand.cell != nullptr) {
+        return std::get_if<int>(operand.cell);
+    }
+    return operand.number;
+}
+
+// Cells downstream of sources, precedents first, found by walking the
+// dependent lists of the structure. Formulas this sheet cleared read
+// nothing, so they are not reached. Cells on a cycle never become ready
+// and are left out, along with everything downstream of them; complete,
+// if given, tells whether any were
+std::vector<std::string> Spreadsheet::downstream_order(
+    const std::vector<std::string>& sources, bool* complete) const
+{
+    const auto& owner = structure();
+    auto for_each_dependent = [&](const std::string& address, auto visit) {
+        auto dep_it = owner.dependencies.find(address);
+        if (dep_it == owner.dependencies.end()) return;
+        for (const auto& dependent : dep_it->second.second) {
+            if (!cleared.contains(dependent)) visit(dependent);
+        }
+    };
+
+    // Cells reached, with their precedent count among them
+    std::unordered_map<std::string, int> cone;
+    std::vector<std::string> stack(sources.begin(), sources.end());
+    while (!stack.empty()) {
+        auto address = std::move(stack.back());
+        stack.pop_back();
+        for_each_dependent(address, [&](const std::string& dependent) {
+            if (cone.try_emplace(dependent, 0).second) {
+                stack.push_back(dependent);
+            }
+        });
+    }
+    for (const auto& [address, count] : cone) {
+        for_each_dependent(address, [&](const std::string& dependent) {
+            ++cone[dependent];
+        });
+    }
+
+    std::vector<std::string> order;
+    for (const auto& [address, count] : cone) {
+        if (count == 0) order.push_back(address);
+    }
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        for_each_dependent(order[i], [&](const std::string& dependent) {
+            if (--cone[dependent] == 0) order.push_back(dependent);
+        });
+    }
+    if (complete != nullptr) *complete = order.size() == cone.size();
+    return order;
+}
+
+// Every cell reading address, directly or through other formulas. Each
+// comes after the cells it reads, except within a cycle. A cell is only
+// its own dependent when it is on a cycle
+std::vector<std::string> Spreadsheet::dependents_of(const std::string& address)
+{
+    return reachable(address, false);
+}
+
+// Every cell address reads, directly or through other formulas, each
+// after the cells it reads except within a cycle
+std::vector<std::string> Spreadsheet::precedents_of(const std::string& address)
+{
+    return reachable(address, true);
+}
+
+// Cells reachable from address along dependent edges, or along
+// precedent edges if upstream, read off the index by walking the ranges
+// of its component
+std::vector<std::string> Spreadsheet::reachable(const std::string& address,
+                                                bool upstream)
+{
+    if (reachability == nullptr) reachability = build_reachability();
+    const auto& index = *reachability;
+    std::vector<std::string> res;
+    auto it = index.ids.find(address);
+    if (it == index.ids.end()) return res;
+
+    int v = it->second;
+    const auto& labels = upstream ? index.precedents : index.dependents;
+    int k = labels.number[index.component[v]];
+    auto emit = [&](int number) {
+        for (int i = labels.member_offsets[number];
+             i < labels.member_offsets[number + 1]; ++i) {
+            int u = labels.members[i];
+            if (u != v || index.on_cycle[v]) res.push_back(index.addresses[u]);
+        }
+    };
+
+    // Post-order puts cells after everything they reach, so dependents
+    // are listed from the highest number down and precedents upwards
+    auto first = labels.intervals.begin() + labels.interval_offsets[k];
+    auto last = labels.intervals.begin() + labels.interval_offsets[k + 1];
+    if (upstream) {
+        for (auto i = first; i != last; ++i) {
+            for (int number = i->first; number <= i->second; ++number) {
+                emit(number);
+            }
+        }
+    }
+    else {
+        for (auto i = last; i != first;) {
+            --i;
+            for (int number = i->second; number >= i->first; --number) {
+                emit(number);
+            }
+        }
+    }
+    return res;
+}
+
+// Interval labelling of the structure's condensed graph in both
+// directions. A component reaches those below it in its depth-first tree
+// plus whatever its successors reach, so its ranges are its own tree range
+// merged with theirs. Successors are numbered first, which lets one pass
+// in number order fill every label
+std::shared_ptr<const Spreadsheet::Reachability>
+Spreadsheet::build_reachability() const
+{
+    const auto& owner = structure();
+    auto graph = owner.build_graph(&cleared);
+    auto sorted = owner.topological_sort_dependencies(graph);
+    std::size_t n = graph.addresses.size();
+
+    auto index = std::make_shared<Reachability>(*owner.account);
+    std::vector<int> number(n, -1);
+    int count = 0;
+    index->component.resize(n);
+    for (int v : sorted.order) {
+        int& c = number[sorted.component[v]];
+        if (c == -1) c = count++;
+        index->component[v] = c;
+    }
+    const auto& component = index->component;
+
+    std::vector<std::vector<int>> down(count);
+    std::vector<std::vector<int>> up(count);
+    for (std::size_t u = 0; u < n; ++u) {
+        for (int e = graph.edge_offsets[u]; e < graph.edge_offsets[u + 1];
+             ++e) {
+            int a = component[u];
+            int b = component[graph.edges[e]];
+            if (a == b) continue;
+            down[a].push_back(b);
+            up[b].push_back(a);
+        }
+    }
+    for (auto* edges : {&down, &up}) {
+        for (auto& next : *edges) {
+            std::sort(next.begin(), next.end());
+            next.erase(std::unique(next.begin(), next.end()), next.end());
+        }
+    }
+
+    auto label = [&](const std::vector<std::vector<int>>& next,
+                     Labelling& out) {
+        // Post-order numbers, and the lowest number below each component
+        out.number.assign(count, -1);
+        std::vector<int> low(count);
+        std::vector<int> by_number(count);
+        std::vector<char> seen(count, 0);
+        std::vector<std::pair<int, std::size_t>> path;  // component, next
+        int counter = 0;
+        for (int root = 0; root < count; ++root) {
+            if (seen[root]) continue;
+            seen[root] = 1;
+            low[root] = counter;
+            path.emplace_back(root, 0);
+            while (!path.empty()) {
+                int c = path.back().first;
+                auto& i = path.back().second;
+                if (i < next[c].size()) {
+                    int d = next[c][i++];
+                    if (!seen[d]) {
+                        seen[d] = 1;
+                        low[d] = counter;
+                        path.emplace_back(d, 0);
+                    }
+                    continue;
+                }
+                out.number[c] = counter;
+                by_number[counter++] = c;
+                path.pop_back();
+            }
+        }
+
+        out.interval_offsets.assign(count + 1, 0);
+        std::vector<std::pair<int, int>> ranges;
+        for (int k = 0; k < count; ++k) {
+            int c = by_number[k];
+            ranges.assign(1, {low[c], k});
+            for (int d : next[c]) {
+                int j = out.number[d];
+                ranges.insert(
+                    ranges.end(),
+                    out.intervals.begin() + out.interval_offsets[j],
+                    out.intervals.begin() + out.interval_offsets[j + 1]);
+            }
+            std::sort(ranges.begin(), ranges.end());
+            auto first = out.intervals.size();
+            for (auto [lo, hi] : ranges) {
+                if (out.intervals.size() > first &&
+                    lo <= out.intervals.back().second + 1) {
+                    auto& back = out.intervals.back().second;
+                    back = std::max(back, hi);
+                }
+                else {
+                    out.intervals.emplace_back(lo, hi);
+                }
+            }
+            out.interval_offsets[k + 1] =
+                static_cast<int>(out.intervals.size());
+        }
+
+        out.member_offsets.assign(count + 1, 0);
+        for (std::size_t v = 0; v < n; ++v) {
+            ++out.member_offsets[out.number[component[v]] + 1];
+        }
+        std::partial_sum(out.member_offsets.begin(), out.member_offsets.end(),
+                         out.member_offsets.begin());
+        out.members.resize(n);
+        auto fill = out.member_offsets;
+        for (std::size_t v = 0; v < n; ++v) {
+            out.members[fill[out.number[component[v]]]++] =
+                static_cast<int>(v);
+        }
+    };
+    label(down, index->dependents);
+    label(up, index->precedents);
+
+    index->on_cycle = std::move(sorted.on_cycle);
+    index->addresses = std::move(graph.addresses);
+    index->ids = std::move(graph.ids);
+    return index;
+}
+
+// Loads the file like parse_input and prints it like print_output, but a
+// writer thread prints each row as soon as its formulas are evaluated
+// rather than after the whole sheet is. Returns false, printing nothing
+// and leaving the sheet empty, once the load goes past the memory budget
+bool Spreadsheet::parse_and_print(std::string file_name, std::ostream& out)
+{
+    begin_load();
+    int rows = parse_rows(file_name);
+    if (rows >= 0 && evaluation_over_budget()) rows = -1;
+    if (rows < 0) {
+        clear();
+        return false;
+    }
+    max_row = rows - 1;
+
+    SpscQueue<int> printable(pipeline_queue_size);
+    std::thread writer([&]() {
+        std::string text;
+        append_header(text);
+        out << text;
+        int row;
+        while (printable.pop(row)) {
+            text.clear();
+            append_row(text, row, max_col);
+            out << text;
+        }
+        out.flush();
+    });
+
+    RowProgress progress{&printable, {}, std::vector<std::atomic<int>>(
+                                             std::max(max_row + 1, 0)),
+                         0};
+    resolve_dependencies(&progress);
+    emit_completed_rows(progress);
+    printable.close();
+    writer.join();
+    return true;
+}
+
+// Parses every row of the file into cells and dependencies. Returns the
+// number of rows, or -1 as soon as the accounted structures grow past the
+// memory budget of the current load. Files estimated to go past it are
+// refused before anything is reserved for them
+int Spreadsheet::parse_rows(const std::string& file_name)
+{
+    if (thread_count > 1) return parse_input_parallel(file_name);
+    auto counts = count_input(file_name);
+    if (over_budget(input_bytes(counts))) return -1;
+    reserve_input(counts);
+
+    std::ifstream file(file_name);
+    std::string line;
+    int row = 0;
+    int col = 0;
+    std::string col_s;
+    while (std::getline(file, line)) {
+        std::stringstream ss(line);
+        std::string cell;
+        col = 0;
+        while (std::getline(ss, cell, ',')) {
+            parse_tokens({col, row}, cell);
+            ++col;
+        }
+        max_col = std::max(max_col, col - 1);
+        ++row;
+        if (over_budget()) return -1;
+    }
+    return row;
+}
+
+void Spreadsheet::InputScanner::end_token()
+{
+    if (token != Start) ++cell_tokens;
+    if (token == Digits) ++cell_references;
+    token = Start;
+}
+
+void Spreadsheet::InputScanner::end_cell()
+{
+    end_token();
+    if (counts.column_cells.size() <= col) {
+        counts.column_cells.resize(col + 1);
+    }
+    ++counts.column_cells[col];
+    ++counts.cells;
+    if (formula) {
+        ++counts.formula_cells;
+        counts.formula_tokens += cell_tokens;
+        counts.references += cell_references;
+        if (cell_length > std::string().capacity()) {
+            counts.text_bytes += cell_length + 1;
+        }
+    }
+    cell_length = 0;
+    cell_tokens = 0;
+    cell_references = 0;
+    formula = false;
+}
+
+void Spreadsheet::InputScanner::scan(std::string_view bytes)
+{
+    for (char byte : bytes) {
+        auto ch = static_cast<unsigned char>(byte);
+        if (ch == ',') {
+            end_cell();
+            ++col;
+        }
+        else if (ch == '\n') {
+            if (cell_length > 0) end_cell();
+            col = 0;
+        }
+        else {
+            ++cell_length;
+            if (std::isspace(ch)) {
+                end_token();
+            }
+            else if (std::isalpha(ch)) {
+                formula = true;
+                token = token == Start || token == Letters ? Letters : Other;
+            }
+            else if (std::isdigit(ch)) {
+                token = token == Letters || token == Digits ? Digits : Other;
+            }
+            else {
+                token = Other;
+            }
+        }
+    }
+}
+
+// Counts of everything scanned, ending the last line if the file does
+Spreadsheet::InputCounts Spreadsheet::InputScanner::finish()
+{
+    if (cell_length > 0) end_cell();
+    return std::move(counts);
+}
+
+// Counts what parse_rows will store from the file, reading it a block at
+// a time
+Spreadsheet::InputCounts Spreadsheet::count_input(
+    const std::string& file_name) const
+{
+    InputScanner scanner;
+    std::ifstream file(file_name, std::ios::binary);
+    std::vector<char> block(count_block_size);
+    while (file) {
+        file.read(block.data(), static_cast<std::streamsize>(block.size()));
+        scanner.scan({block.data(), static_cast<std::size_t>(file.gcount())});
+    }
+    return scanner.finish();
+}
+
+// Sizes cells, dependencies and programs for what counts describes, on
+// top of what they already hold. Columns are created here, which parsing
+// would do anyway. Graph entries are formulas plus the cells they read,
+// at most one per reference
+void Spreadsheet::reserve_input(const InputCounts& counts)
+{
+    cells.reserve(cells.size() + counts.column_cells.size());
+    for (std::size_t col = 0; col < counts.column_cells.size(); ++col) {
+        auto& column = cells[static_cast<int>(col)];
+        column.reserve(column.size() + counts.column_cells[col]);
+    }
+    auto read_cells = std::min(counts.references,
+                               counts.cells - counts.formula_cells);
+    dependencies.reserve(dependencies.size() + counts.formula_cells +
+                         read_cells);
+    programs.reserve(programs.size() + counts.formula_cells);
+}
+
+// Parses, evaluates and prints the file in three pipelined stages joined
+// by bounded queues: a parser thread compiles rows, this thread stores
+// literals and evaluates each formula as soon as its operands are final,
+// and a writer thread prints rows in order once they are complete. The
+// sheet width is not known until the end, so no column header is printed
+// and each row lists only its own columns.
+//
+// While no waiting formula reads a row beyond the last one parsed (sheets
+// that only reference earlier rows or the same row), waiting formulas can
+// never complete and fail right away, so every row is printed as soon as
+// it is read. With a stream window set, older rows are then dropped and
+// the graph is not recorded, so memory stays bounded; references to
+// dropped rows read as undefined. A row also waits to be printed for at
+// most that many rows: formulas of it still waiting then fail, as if what
+// they wait on were undefined.
+//
+// Returns false once the load goes past the memory budget, checked after
+// each row: parsing stops, rows already printed stay printed and the
+// sheet is left empty
+bool Spreadsheet::parse_input_pipelined(std::string file_name,
+                                        std::ostream& out)
+{
+    begin_load();
+    SpscQueue<ParsedRow> parsed(pipeline_queue_size);
+    SpscQueue<std::string> printable(pipeline_queue_size);
+    std::atomic<bool> exhausted{false};
+
+    std::thread parser([&]() {
+        std::ifstream file(file_name);
+        std::string line;
+        int row = 0;
+        while (!exhausted.load(std::memory_order_relaxed) &&
+               std::getline(file, line)) {
+            ParsedRow parsed_row{row, 0, ParseBuffer(*account)};
+            parsed_row.buffer.shards.emplace_back(*account);
+            std::stringstream ss(line);
+            std::string cell;
+            int col = 0;
+            while (std::getline(ss, cell, ',')) {
+                parse_tokens({col, row}, cell, parsed_row.buffer);
+                ++col;
+            }
+            parsed_row.width = col;
+            parsed.push(std::move(parsed_row));
+            ++row;
+        }
+        parsed.close();
+    });
+    std::thread writer([&]() {
+        std::string text;
+        while (printable.pop(text)) out << text;
+        out.flush();
+    });
+
+    // Formulas not yet evaluated, in reusable slots, which of them wait
+    // on each address, and how many waits are on each row
+    struct Pending {
+        std::pair<int, int> coords;
+        Program program;
+        int waiting = 0;
+        bool active = false;
+    };
+    std::vector<Pending> formulas;
+    std::vector<std::size_t> free_slots;
+    std::size_t active_formulas = 0;
+    std::unordered_map<std::string, std::vector<std::size_t>> waiters;
+    std::vector<std::size_t> ready;
+    std::map<int, std::size_t> waited_rows;
+
+    // Rows not yet dropped, starting at first_row
+    struct RowState {
+        int pending = 0;
+        int width = 0;
+    };
+    std::deque<RowState> rows;
+    int first_row = 0;
+    int next_row = 0;
+    bool record_graph = stream_window == 0;
+
+    auto is_final = [&](const std::pair<int, int>& coords) {
+        auto col_it = cells.find(coords.first);
+        return col_it != cells.end() && col_it->second.contains(coords.second);
+    };
+    auto unwait = [&](int row, std::size_t count) {
+        auto row_it = waited_rows.find(row);
+        if ((row_it->second -= count) == 0) waited_rows.erase(row_it);
+    };
+    auto finalize = [&](const std::pair<int, int>& coords) {
+        auto waiter_it = waiters.find(coords_to_address(coords));
+        if (waiter_it == waiters.end()) return;
+        for (auto id : waiter_it->second) {
+            if (--formulas[id].waiting == 0) ready.push_back(id);
+        }
+        unwait(coords.second, waiter_it->second.size());
+        waiters.erase(waiter_it);
+    };
+    auto finish = [&](std::size_t id, CellValue value) {
+        auto& formula = formulas[id];
+        cells[formula.coords.first][formula.coords.second] = value;
+        --rows[formula.coords.second - first_row].pending;
+        if (record_graph) {
+            programs[coords_to_address(formula.coords)] =
+                std::move(formula.program);
+        }
+        formula.active = false;
+        free_slots.push_back(id);
+        --active_formulas;
+        finalize(formula.coords);
+    };
+    auto evaluate_ready = [&]() {
+        std::vector<Operand> operands;
+        while (!ready.empty()) {
+            auto id = ready.back();
+            ready.pop_back();
+            operands.clear();
+            for (const auto& op : formulas[id].program) {
+                if (op.kind == Op::Kind::Reference) {
+                    operands.push_back(
+                        {&cells[op.coords.first][op.coords.second]});
+                }
+            }
+            finish(id, evaluate_program(formulas[id].program, operands.data()));
+        }
+    };
+    auto fail_waiting = [&]() {
+        waiters.clear();
+        waited_rows.clear();
+        for (std::size_t id = 0; id < formulas.size(); ++id) {
+            if (formulas[id].active) finish(id, CellState::Error);
+        }
+    };
+    // Fails the formulas of one row, taking them off what they wait on,
+    // then evaluates those that were waiting on them. Those readied by an
+    // earlier failure, in the row too, are evaluated rather than failed
+    auto fail_row = [&](int row) {
+        for (std::size_t id = 0; id < formulas.size(); ++id) {
+            auto& formula = formulas[id];
+            if (!formula.active || formula.waiting == 0 ||
+                formula.coords.second != row) {
+                continue;
+            }
+            for (const auto& op : formula.program) {
+                if (op.kind != Op::Kind::Reference) continue;
+                auto waiter_it = waiters.find(coords_to_address(op.coords));
+                if (waiter_it == waiters.end()) continue;
+                auto& ids = waiter_it->second;
+                auto kept = std::remove(ids.begin(), ids.end(), id);
+                if (kept == ids.end()) continue;
+                unwait(op.coords.second,
+                       static_cast<std::size_t>(ids.end() - kept));
+                ids.erase(kept, ids.end());
+                if (ids.empty()) waiters.erase(waiter_it);
+            }
+            finish(id, CellState::Error);
+        }
+        evaluate_ready();
+    };
+    auto emit_rows = [&]() {
+        while (next_row - first_row < static_cast<int>(rows.size()) &&
+               rows[next_row - first_row].pending == 0) {
+            std::string text;
+            append_row(text, next_row, rows[next_row - first_row].width - 1);
+            printable.push(std::move(text));
+            ++next_row;
+        }
+        while (stream_window > 0 && first_row < next_row - stream_window) {
+            for (int col = 0; col < rows.front().width; ++col) {
+                auto col_it = cells.find(col);
+                if (col_it != cells.end()) col_it->second.erase(first_row);
+            }
+            rows.pop_front();
+            ++first_row;
+        }
+    };
+
+    ParsedRow parsed_row;
+    while (parsed.pop(parsed_row)) {
+        max_col = std::max(max_col, parsed_row.width - 1);
+        rows.push_back({0, parsed_row.width});
+
+        auto& shard = parsed_row.buffer.shards.front();
+        for (auto& [col, row, value] : shard.values) {
+            cells[col][row] = value;
+            finalize({col, row});
+        }
+        if (record_graph) {
+            for (auto& [precedent, dependent] : shard.edges) {
+                dependencies[precedent].second.push_back(std::move(dependent));
+            }
+        }
+        for (auto& [address, formula, program] : shard.formulas) {
+            if (record_graph) {
+                dependencies[address].first = std::move(formula);
+            }
+            std::size_t id = formulas.size();
+            if (!free_slots.empty()) {
+                id = free_slots.back();
+                free_slots.pop_back();
+            }
+            else {
+                formulas.push_back({{}, Program(*account), 0, false});
+            }
+            auto& pending = formulas[id];
+            pending = {address_to_coords(address), std::move(program), 0, true};
+            for (const auto& op : pending.program) {
+                if (op.kind == Op::Kind::Reference && !is_final(op.coords)) {
+                    waiters[coords_to_address(op.coords)].push_back(id);
+                    ++waited_rows[op.coords.second];
+                    ++pending.waiting;
+                }
+            }
+            if (pending.waiting == 0) ready.push_back(id);
+            ++active_formulas;
+            ++rows.back().pending;
+        }
+        evaluate_ready();
+
+        // Nothing waits on a row still to come, so waiting formulas read an
+        // undefined cell or lie on a cycle
+        bool waits_ahead = !waited_rows.empty() &&
+                           waited_rows.rbegin()->first > parsed_row.row;
+        if (active_formulas > 0 && !waits_ahead) fail_waiting();
+        emit_rows();
+        // A row held back for the whole window fails what it waits on
+        while (stream_window > 0 &&
+               next_row <= parsed_row.row - stream_window) {
+            fail_row(next_row);
+            emit_rows();
+        }
+        if (over_budget()) {
+            exhausted.store(true, std::memory_order_relaxed);
+            break;
+        }
+    }
+
+    if (exhausted) {
+        // The parser may be blocked on a full queue until drained
+        while (parsed.pop(parsed_row)) {
+        }
+    }
+    else {
+        fail_waiting();
+        emit_rows();
+        max_row = next_row - 1;
+    }
+
+    printable.close();
+    parser.join();
+    writer.join();
+    if (exhausted) clear();
+    return !exhausted;
+}
+
+void Spreadsheet::print_output()
+{
+    // Print column headers
+    std::string line;
+    append_header(line);
+    std::cout << line;
+
+    // Print each row. Ranges of rows are formatted concurrently and
+    // printed in order
+    int rows = std::max(max_row + 1, 0);
+    std::vector<std::string> chunks(thread_count);
+    parallel_for(rows, [&](std::size_t first, std::size_t last,
+                           std::size_t c) {
+        for (auto row = first; row < last; ++row) {
+            append_row(chunks[c], static_cast<int>(row), max_col);
+        }
+    });
+    for (const auto& chunk : chunks) std::cout << chunk;
+    std::cout.flush();
+
+    // print_dependencies();
+}
+
+// Writes the output of print_output to a file. Each thread first measures
+// its range of rows, which fixes where the range lands in the file, then
+// formats it in blocks written with pwrite at their final offsets. Returns
+// false if the file could not be written
+bool Spreadsheet::write_output(std::string file_name)
+{
+    std::string header;
+    append_header(header);
+
+    int rows = std::max(max_row + 1, 0);
+    std::vector<std::size_t> offsets(thread_count + 1, 0);
+    parallel_for(rows, [&](std::size_t first, std::size_t last,
+                           std::size_t c) {
+        for (auto row = first; row < last; ++row) {
+            offsets[c + 1] += row_size(static_cast<int>(row), max_col);
+        }
+    });
+    offsets[0] = header.size();
+    for (std::size_t c = 0; c < thread_count; ++c) {
+        offsets[c + 1] += offsets[c];
+    }
+
+    int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    std::atomic<bool> ok =
+        ftruncate(fd, static_cast<off_t>(offsets[thread_count])) == 0;
+    auto write_at = [&](const std::string& text, std::size_t offset) {
+        for (std::size_t done = 0; done < text.size();) {
+            auto n = pwrite(fd, text.data() + done, text.size() - done,
+                            static_cast<off_t>(offset + done));
+            if (n <= 0) {
+                ok = false;
+                return;
+            }
+            done += static_cast<std::size_t>(n);
+        }
+    };
+    write_at(header, 0);
+    parallel_for(rows, [&](std::size_t first, std::size_t last,
+                           std::size_t c) {
+        std::string block;
+        auto offset = offsets[c];
+        for (auto row = first; row < last; ++row) {
+            append_row(block, static_cast<int>(row), max_col);
+            if (block.size() >= write_block_size || row + 1 == last) {
+                write_at(block, offset);
+                offset += block.size();
+                block.clear();
+            }
+        }
+    });
+    return close(fd) == 0 && ok;
+}
+
+void Spreadsheet::append_header(std::string& out)
+{
+    out += '\t';
+    for (int col = 0; col <= max_col; ++col) {
+        out += coord_to_col(col);
+        out += '\t';
+    }
+    out += '\n';
+}
+
+// Appends the printed form of a row, up to and including last_col
+void Spreadsheet::append_row(std::string& out, int row, int last_col)
+{
+    out += std::to_string(row);
+    out += '\t';
+    for (int col = 0; col <= last_col; ++col) {
+        auto operand = lookup(col, row);
+        if (operand.cell != nullptr) {
+            const auto& cell = *operand.cell;
+            if (std::holds_alternative<int>(cell)) {
+                out += std::to_string(std::get<int>(cell));
+                out += '\t';
+            }
+            else if (is_empty(cell)) {
+                out += '\t';
+            }
+            else if (is_error(cell)) {
+                out += "#ERR\t";
+            }
+        }
+        else if (operand.number != nullptr) {
+            out += std::to_string(*operand.number);
+            out += '\t';
+        }
+        else if (has_column(col)) {
+            out += '\t';
+        }
+    }
+    out += '\n';
+}
+
+// Writes the evaluated sheet as an Arrow IPC file with one record batch.
+// Each sheet column becomes an int32 column, null unless the cell holds a
+// number, followed by a non-nullable bool column flagging #ERR cells.
+// Buffers are 8-byte aligned so readers can map the file and use the
+// columns in place. Returns false if the file could not be written
+bool Spreadsheet::export_arrow(std::string file_name)
+{
+    std::int64_t rows = std::max(max_row + 1, 0);
+    int cols = max_col + 1;
+    auto padded = [](std::int64_t size) { return (size + 7) / 8 * 8; };
+    std::int64_t bitmap_size = (rows + 7) / 8;
+
+    // Buffers of one column. Sheets this one was cloned from are applied
+    // first so later cells override theirs
+    std::vector<const Spreadsheet*> layers;
+    for (const Spreadsheet* sheet = this; sheet != nullptr;
+         sheet = sheet->base.get()) {
+        layers.insert(layers.begin(), sheet);
+    }
+    std::string values(padded(rows * 4), '\0');
+    std::string validity(padded(bitmap_size), '\0');
+    std::string errors(padded(bitmap_size), '\0');
+    auto build_column = [&](int col) {
+        std::fill(values.begin(), values.end(), '\0');
+        std::fill(validity.begin(), validity.end(), '\0');
+        std::fill(errors.begin(), errors.end(), '\0');
+        auto set_number = [&](std::int64_t row, int number) {
+            auto value = static_cast<std::uint32_t>(number);
+            for (int i = 0; i < 4; ++i) {
+                values[row * 4 + i] = static_cast<char>(value >> (8 * i));
+            }
+            validity[row / 8] |= static_cast<char>(1 << (row % 8));
+        };
+        for (auto sheet : layers) {
+            if (col < static_cast<int>(sheet->adopted.size())) {
+                const auto& numbers = sheet->adopted[col];
+                auto count = std::min<std::int64_t>(numbers.size(), rows);
+                for (std::int64_t row = 0; row < count; ++row) {
+                    set_number(row, numbers[row]);
+                }
+            }
+            auto col_it = sheet->cells.find(col);
+            if (col_it == sheet->cells.end()) continue;
+            for (const auto& [row, cell] : col_it->second) {
+                if (row > max_row) continue;
+                auto bit = static_cast<char>(1 << (row % 8));
+                validity[row / 8] &= static_cast<char>(~bit);
+                errors[row / 8] &= static_cast<char>(~bit);
+                if (std::holds_alternative<int>(cell)) {
+                    set_number(row, std::get<int>(cell));
+                }
+                else if (is_error(cell)) {
+                    errors[row / 8] |= bit;
+                }
+            }
+        }
+    };
+
+    // Number of valid values in each column, needed before the body
+    std::vector<std::int64_t> valid(cols, 0);
+    for (int col = 0; col < cols; ++col) {
+        build_column(col);
+        for (char byte : validity) {
+            valid[col] += std::popcount(static_cast<unsigned char>(byte));
+        }
+    }
+
+    // Field nodes and buffers (validity, then data) of every field
+    std::vector<std::int64_t> nodes;
+    std::vector<std::int64_t> buffers;
+    std::int64_t body_size = 0;
+    auto add_buffer = [&](std::int64_t size) {
+        buffers.push_back(body_size);
+        buffers.push_back(size);
+        body_size += padded(size);
+    };
+    for (int col = 0; col < cols; ++col) {
+        nodes.insert(nodes.end(), {rows, rows - valid[col]});
+        add_buffer(bitmap_size);
+        add_buffer(rows * 4);
+        nodes.insert(nodes.end(), {rows, 0});
+        add_buffer(0);
+        add_buffer(bitmap_size);
+    }
+
+    auto write_schema = [&](FlatBufferWriter& fb) {
+        std::vector<std::size_t> slots;
+        auto schema = fb.table({{0, 2, 0}, {1, 0}}, slots);
+        auto fields = fb.offsets(2 * cols);
+        fb.patch(slots[0], fields);
+        for (int i = 0; i < 2 * cols; ++i) {
+            bool error = i % 2 == 1;
+            std::vector<std::size_t> field_slots;
+            auto field = fb.table(
+                {{0, 0}, {1, 1, !error}, {2, 1, error ? 6 : 2}, {3, 0}, {5, 0}},
+                field_slots);
+            fb.patch(fields + 4 + 4 * i, field);
+            fb.patch(field_slots[0],
+                     fb.string(coord_to_col(i / 2) + (error ? "_error" : "")));
+            std::vector<std::size_t> none;
+            fb.patch(field_slots[1], error ? fb.table({}, none)
+                                           : fb.table({{0, 4, 32}, {1, 1, 1}},
+                                                      none));
+            fb.patch(field_slots[2], fb.offsets(0));
+        }
+        return schema;
+    };
+    auto message = [&](int header_type, std::int64_t body_length,
+                       auto write_header) {
+        FlatBufferWriter fb;
+        std::vector<std::size_t> slots;
+        auto root = fb.table(
+            {{0, 2, 4}, {1, 1, header_type}, {2, 0}, {3, 8, body_length}},
+            slots);
+        fb.set_root(root);
+        fb.patch(slots[0], write_header(fb));
+        return fb.finish();
+    };
+
+    std::ofstream file(file_name, std::ios::binary | std::ios::trunc);
+    auto put_int32 = [&](std::uint32_t value) {
+        char le[4];
+        for (int i = 0; i < 4; ++i) le[i] = static_cast<char>(value >> (8 * i));
+        file.write(le, 4);
+    };
+    auto put_message = [&](const std::string& metadata) {
+        put_int32(0xffffffff);
+        put_int32(static_cast<std::uint32_t>(metadata.size()));
+        file << metadata;
+    };
+    file.write("ARROW1\0\0", 8);
+    put_message(message(1, 0, write_schema));
+
+    auto batch_offset = static_cast<std::int64_t>(file.tellp());
+    auto batch = message(3, body_size, [&](FlatBufferWriter& fb) {
+        std::vector<std::size_t> slots;
+        auto record_batch = fb.table({{0, 8, rows}, {1, 0}, {2, 0}}, slots);
+        fb.patch(slots[0], fb.structs(nodes, nodes.size() / 2));
+        fb.patch(slots[1], fb.structs(buffers, buffers.size() / 2));
+        return record_batch;
+    });
+    put_message(batch);
+
+    // Body, one column at a time
+    for (int col = 0; col < cols; ++col) {
+        build_column(col);
+        file << validity << values << errors;
+    }
+    put_int32(0xffffffff);
+    put_int32(0);
+
+    FlatBufferWriter footer;
+    std::vector<std::size_t> slots;
+    auto root = footer.table({{0, 2, 4}, {1, 0}, {2, 0}, {3, 0}}, slots);
+    footer.set_root(root);
+    footer.patch(slots[0], write_schema(footer));
+    footer.patch(slots[1], footer.structs({}, 0));
+    footer.patch(slots[2],
+                 footer.structs({batch_offset,
+                                 static_cast<std::int64_t>(batch.size() + 8),
+                                 body_size},
+                                1));
+    file << footer.finish();
+    put_int32(static_cast<std::uint32_t>(footer.finish().size()));
+    file.write("ARROW1", 6);
+    return static_cast<bool>(file);
+}
+
+// Length of the row as printed by append_row
+std::size_t Spreadsheet::row_size(int row, int last_col)
+{
+    auto digits = [](int value) {
+        char buffer[16];
+        return static_cast<std::size_t>(
+            std::to_chars(buffer, buffer + sizeof(buffer), value).ptr -
+            buffer);
+    };
+    std::size_t size = digits(row) + 2;  // row, tab and newline
+    for (int col = 0; col <= last_col; ++col) {
+        auto operand = lookup(col, row);
+        if (operand.cell != nullptr) {
+            const auto& cell = *operand.cell;
+            if (std::holds_alternative<int>(cell)) {
+                size += digits(std::get<int>(cell)) + 1;
+            }
+            else if (is_empty(cell)) {
+                size += 1;
+            }
+            else if (is_error(cell)) {
+                size += 5;
+            }
+        }
+        else if (operand.number != nullptr) {
+            size += digits(*operand.number) + 1;
+        }
+        else if (has_column(col)) {
+            size += 1;
+        }
+    }
+    return size;
+}
+
+void Spreadsheet::parse_tokens(std::pair<int, int> cell_coords,
+                               const std::string& cell_contents)
+{
+    // If contains dependency, record dependencies and computation for later
+    if (contains_letter(cell_contents)) {
+        std::string cell_address = coords_to_address(cell_coords);
+
+        // Check if cell exists in dependencies already. Update cell_contents
+        auto dep_it = dependencies.find(cell_address);
+        if (dep_it != dependencies.end()) {
+            dep_it->second.first = cell_contents;
+        }
+        else {
+            dependencies[cell_address].first = cell_contents;
+        }
+
+        // Update downstream dependencies
+        std::istringstream iss(cell_contents);
+        std::string token;
+        while (iss >> token) {
+            if (is_letter_number_format(token)) {
+                dependencies[token].second.push_back(cell_address);
+            }
+        }
+        programs[cell_address] = compile_formula(cell_contents);
+    }
+
+    // Calculate prefix value
+    else {
+        calculate_postfix(cell_coords, cell_contents);
+    }
+}
+
+// Parses the file on thread_count threads, each taking a contiguous run of
+// lines into its own buffer. The buffers are then merged shard by shard
+// in parallel, and the shard maps spliced into dependencies and programs
+// without copying their nodes. The file is read once: each thread counts
+// its chunk for the estimate and reserve_input before parsing it. Returns
+// the number of rows, or -1 once the file text, the buffers and the shard
+// maps together go past the memory budget
+int Spreadsheet::parse_input_parallel(const std::string& file_name)
+{
+    std::ifstream file(file_name, std::ios::binary | std::ios::ate);
+    std::basic_string<char, std::char_traits<char>,
+                      CountingAllocator<char, MemoryArea::Parsing>>
+        text(*account);
+    if (file) {
+        auto size = static_cast<std::size_t>(file.tellg());
+        if (over_budget(size)) return -1;
+        text.resize(size);
+        file.seekg(0);
+        file.read(text.data(), static_cast<std::streamsize>(text.size()));
+    }
+
+    // An exception on any thread is rethrown here once all have joined
+    unsigned threads = thread_count;
+    auto on_each_thread = [&](auto body) {
+        std::vector<std::exception_ptr> errors(threads);
+        auto guarded = [&](unsigned t) {
+            try {
+                body(t);
+            }
+            catch (...) {
+                errors[t] = std::current_exception();
+            }
+        };
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < threads; ++t) {
+            workers.emplace_back(guarded, t);
+        }
+        guarded(0u);
+        for (auto& w : workers) w.join();
+        for (const auto& error : errors) {
+            if (error) std::rethrow_exception(error);
+        }
+    };
+
+    // Chunks start at line boundaries. Count rows per chunk to number them
+    std::vector<std::size_t> chunk_begin(threads + 1, text.size());
+    for (unsigned t = 0; t < threads; ++t) {
+        auto pos = text.size() * t / threads;
+        if (pos != 0) {
+            auto newline = text.find('\n', pos - 1);
+            pos = newline == std::string::npos ? text.size() : newline + 1;
+        }
+        chunk_begin[t] = std::max(pos, t == 0 ? 0 : chunk_begin[t - 1]);
+    }
+    std::vector<int> chunk_rows(threads + 1, 0);
+    std::vector<InputCounts> chunk_counts(threads);
+    on_each_thread([&](unsigned t) {
+        auto first = text.begin() + chunk_begin[t];
+        auto last = text.begin() + chunk_begin[t + 1];
+        int rows = static_cast<int>(std::count(first, last, '\n'));
+        if (first != last && *(last - 1) != '\n') ++rows;
+        chunk_rows[t + 1] = rows;
+        InputScanner scanner;
+        scanner.scan({text.data() + chunk_begin[t],
+                      chunk_begin[t + 1] - chunk_begin[t]});
+        chunk_counts[t] = scanner.finish();
+    });
+    for (unsigned t = 0; t < threads; ++t) chunk_rows[t + 1] += chunk_rows[t];
+    for (unsigned t = 1; t < threads; ++t) {
+        chunk_counts[0].merge(chunk_counts[t]);
+    }
+    if (over_budget(input_bytes(chunk_counts[0]))) return -1;
+    reserve_input(chunk_counts[0]);
+
+    // Set by the first thread to find the load over budget, which stops
+    // the others
+    std::atomic<bool> exhausted{false};
+    auto exhaust = [&]() {
+        if (exhausted.load(std::memory_order_relaxed)) return true;
+        if (!over_budget()) return false;
+        exhausted.store(true, std::memory_order_relaxed);
+        return true;
+    };
+
+    // Lines and cells are split in place as getline would split them: no
+    // line after a final newline, and no cell after a final comma
+    std::vector<ParseBuffer> buffers(threads, ParseBuffer(*account));
+    on_each_thread([&](unsigned t) {
+        auto& buffer = buffers[t];
+        for (unsigned s = 0; s < threads; ++s) {
+            buffer.shards.emplace_back(*account);
+        }
+        std::string_view chunk(text.data() + chunk_begin[t],
+                               chunk_begin[t + 1] - chunk_begin[t]);
+        std::string cell;
+        int row = chunk_rows[t];
+        while (!chunk.empty()) {
+            auto line = chunk.substr(0, chunk.find('\n'));
+            chunk.remove_prefix(std::min(line.size() + 1, chunk.size()));
+            int col = 0;
+            while (!line.empty()) {
+                auto field = line.substr(0, line.find(','));
+                line.remove_prefix(std::min(field.size() + 1, line.size()));
+                cell.assign(field);
+                parse_tokens({col, row}, cell, buffer);
+                ++col;
+            }
+            buffer.max_col = std::max(buffer.max_col, col - 1);
+            ++row;
+            if (exhaust()) break;
+        }
+    });
+    if (exhausted) return -1;
+
+    for (const auto& buffer : buffers) {
+        max_col = std::max(max_col, buffer.max_col);
+    }
+    for (const auto& buffer : buffers) {
+        for (const auto& shard : buffer.shards) {
+            for (const auto& [col, row, value] : shard.values) cells[col];
+        }
+    }
+
+    // Shard s owns the columns and addresses that hash to it, so no two
+    // threads touch the same map. Buffers are merged in row order
+    std::vector<Dependencies> shard_dependencies(threads,
+                                                 Dependencies(*account));
+    std::vector<Programs> shard_programs(threads, Programs(*account));
+    on_each_thread([&](unsigned s) {
+        auto& shard_deps = shard_dependencies[s];
+        auto& shard_progs = shard_programs[s];
+        for (auto& buffer : buffers) {
+            if (exhaust()) break;
+            auto& shard = buffer.shards[s];
+            for (auto& [col, row, value] : shard.values) {
+                cells.find(col)->second[row] = value;
+            }
+            for (auto& [address, formula, program] : shard.formulas) {
+                shard_deps[address].first = std::move(formula);
+                shard_progs[address] = std::move(program);
+            }
+            for (auto& [precedent, dependent] : shard.edges) {
+                shard_deps[precedent].second.push_back(std::move(dependent));
+            }
+            shard = ParseBuffer::Shard(*account);
+        }
+    });
+    if (exhausted) return -1;
+
+    // Cells parsed before this call keep their entries. Merge into them
+    for (unsigned s = 0; s < threads; ++s) {
+        dependencies.merge(shard_dependencies[s]);
+        for (auto& [address, entry] : shard_dependencies[s]) {
+            auto& existing = dependencies[address];
+            if (!entry.first.empty()) existing.first = std::move(entry.first);
+            existing.second.insert(existing.second.end(),
+                                   std::make_move_iterator(entry.second.begin()),
+                                   std::make_move_iterator(entry.second.end()));
+        }
+        programs.merge(shard_programs[s]);
+        for (auto& [address, program] : shard_programs[s]) {
+            programs[address] = std::move(program);
+        }
+    }
+    return over_budget() ? -1 : chunk_rows[threads];
+}
+
+// Like parse_tokens, but records into a parser thread's buffer
+void Spreadsheet::parse_tokens(std::pair<int, int> cell_coords,
+                               const std::string& cell_contents,
+                               ParseBuffer& buffer)
+{
+    auto shard_of = [&](const std::string& address) -> ParseBuffer::Shard& {
+        return buffer.shards[std::hash<std::string>{}(address) %
+                             buffer.shards.size()];
+    };
+
+    if (contains_letter(cell_contents)) {
+        std::string cell_address = coords_to_address(cell_coords);
+        std::istringstream iss(cell_contents);
+        std::string token;
+        while (iss >> token) {
+            if (is_letter_number_format(token)) {
+                shard_of(token).edges.emplace_back(token, cell_address);
+            }
+        }
+        shard_of(cell_address)
+            .formulas.emplace_back(cell_address, cell_contents,
+                                   compile_formula(cell_contents));
+    }
+    else {
+        buffer.shards[cell_coords.first % buffer.shards.size()]
+            .values.emplace_back(
+                cell_coords.first, cell_coords.second,
+                evaluate_program(compile_formula(cell_contents), nullptr));
+    }
+}
+
+void Spreadsheet::calculate_postfix(std::pair<int, int> cell_coords,
+                                    const std::string& expression)
+{
+    cells[cell_coords.first][cell_coords.second] =
+        evaluate_program(compile_formula(expression), nullptr);
+}
+
+Spreadsheet::Program Spreadsheet::compile_formula(const std::string& formula)
+{
+    // One op per token, allocated up front
+    Program program(*account);
+    std::size_t tokens = 0;
+    bool in_token = false;
+    for (char ch : formula) {
+        bool space = std::isspace(static_cast<unsigned char>(ch));
+        if (!space && !in_token) ++tokens;
+        in_token = !space;
+    }
+    program.reserve(tokens);
+
+    std::istringstream iss(formula);
+    std::string token;
+    while (iss >> token) {
+        Op op;
+        if (token == "+") {
+            op.kind = Op::Kind::Add;
+        }
+        else if (token == "-") {
+            op.kind = Op::Kind::Subtract;
+        }
+        else if (token == "*") {
+            op.kind = Op::Kind::Multiply;
+        }
+        else if (token == "/") {
+            op.kind = Op::Kind::Divide;
+        }
+        else if (std::isalpha(static_cast<unsigned char>(token[0])) &&
+                 is_letter_number_format(token)) {
+            op.kind = Op::Kind::Reference;
+            op.coords = address_to_coords(token);
+        }
+        else {
+            // Read as std::stoi would, but a token that is no number or
+            // does not fit in an int is left Invalid, an error
+            errno = 0;
+            char* end = nullptr;
+            auto value = std::strtol(token.c_str(), &end, 10);
+            if (end != token.c_str() && errno != ERANGE &&
+                value >= std::numeric_limits<int>::min() &&
+                value <= std::numeric_limits<int>::max()) {
+                op.value = static_cast<int>(value);
+                op.kind = Op::Kind::Number;
+            }
+        }
+        program.push_back(op);
+    }
+    return program;
+}
+
+// Operands holds one operand per Reference op, in program order
+Spreadsheet::CellValue Spreadsheet::evaluate_program(const Program& program,
+                                                     const Operand* operands)
+{
+    thread_local std::vector<int> stack;
+    stack.clear();
+    for (const auto& op : program) {
+        if (op.kind == Op::Kind::Number) {
+            stack.push_back(op.value);
+            continue;
+        }
+        if (op.kind == Op::Kind::Reference) {
+            const auto& operand = *operands++;
+            if (operand.number != nullptr) {
+                stack.push_back(*operand.number);
+                continue;
+            }
+            const CellValue* cell = operand.cell;
+            if (cell == nullptr || !std::holds_alternative<int>(*cell)) {
+                return CellState::Error;
+            }
+            stack.push_back(std::get<int>(*cell));
+            continue;
+        }
+        if (op.kind == Op::Kind::Invalid || stack.size() < 2) {
+            return CellState::Error;
+        }
+
+        // Pop operands
+        int op1 = stack.back();
+        stack.pop_back();
+        int op2 = stack.back();
+        stack.pop_back();
+
+        // Perform operation
+        int result = 0;
+        if (op.kind == Op::Kind::Add) {
+            result = op1 + op2;
+        }
+        else if (op.kind == Op::Kind::Subtract) {
+            result = op1 - op2;
+        }
+        else if (op.kind == Op::Kind::Multiply) {
+            result = op1 * op2;
+        }
+        else if (op.kind == Op::Kind::Divide) {
+            if (op2 == 0) {
+                return CellState::Error;
+            }
+            result = op1 / op2;
+        }
+        stack.push_back(result);
+    }
+    return stack.size() == 1 ? CellValue(stack.back()) : CellState::Error;
+}
+
+// Touches the operand cells of an upcoming step so they are in cache by
+// the time it is evaluated
+void Spreadsheet::prefetch_operands(const Step& step,
+                                    std::span<const Operand> operands)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    for (std::size_t i = 0; i < step.operand_count; ++i) {
+        const auto& operand = operands[step.first_operand + i];
+        if (operand.number != nullptr) {
+            __builtin_prefetch(operand.number);
+        }
+        else {
+            __builtin_prefetch(operand.cell);
+        }
+    }
+#endif
+}
+
+// With progress set, rows are handed to its writer as they complete
+void Spreadsheet::resolve_dependencies(RowProgress* progress)
+{
+    auto graph = build_graph();
+    auto sorted = thread_count > 1 ? analyse_graph_parallel(graph)
+                                   : topological_sort_dependencies(graph);
+
+    // Cells on a cycle are errors and are not evaluated, unless iterative
+    // calculation is on and they start from 0
+    bool iterate = iteration_limit > 0;
+    for (std::size_t v = 0; v < graph.addresses.size(); ++v) {
+        if (sorted.on_cycle[v]) {
+            auto coords = address_to_coords(graph.addresses[v]);
+            cells[coords.first][coords.second] =
+                iterate ? CellValue(0) : CellState::Error;
+        }
+    }
+
+    auto plan = build_plan(graph.addresses);
+    if (iterate) {
+        // Rows are only handed over once every cycle has settled
+        evaluate_iterative(graph, plan, sorted);
+        if (progress != nullptr) emit_completed_rows(*progress);
+        return;
+    }
+    if (progress != nullptr) {
+        track_rows(*progress, graph, sorted.on_cycle);
+    }
+    if (thread_count > 1) {
+        evaluate_parallel(graph, plan, sorted.on_cycle, progress);
+        return;
+    }
+
+    const auto& order = sorted.order;
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        if (i + prefetch_distance < order.size()) {
+            prefetch_operands(plan.steps[order[i + prefetch_distance]],
+                              plan.operands);
+        }
+        if (sorted.on_cycle[order[i]]) continue;
+        evaluate_step(plan, order[i]);
+        if (progress != nullptr && plan.steps[order[i]].program != nullptr) {
+            int row = progress->node_rows[order[i]];
+            if (--progress->pending[row] == 0 && row == progress->next_row) {
+                emit_completed_rows(*progress);
+            }
+        }
+    }
+}
+
+// Counts the formulas to evaluate in each row and hands over the rows that
+// have none. Cells must not be added or removed after this, since the
+// writer reads them concurrently
+void Spreadsheet::track_rows(RowProgress& progress,
+                             const DependencyGraph& graph,
+                             const std::vector<char>& on_cycle)
+{
+    progress.node_rows.assign(graph.addresses.size(), 0);
+    for (std::size_t v = 0; v < graph.addresses.size(); ++v) {
+        if (graph.programs[v] == nullptr || on_cycle[v]) continue;
+        int row = address_to_coords(graph.addresses[v]).second;
+        progress.node_rows[v] = row;
+        ++progress.pending[row];
+    }
+    emit_completed_rows(progress);
+}
+
+// Hands every complete row after the last one handed over to the writer
+void Spreadsheet::emit_completed_rows(RowProgress& progress)
+{
+    while (progress.next_row < static_cast<int>(progress.pending.size()) &&
+           progress.pending[progress.next_row] == 0) {
+        progress.printable->push(progress.next_row++);
+    }
+}
+
+// Builds one step per address, in the given order
+Spreadsheet::Plan Spreadsheet::build_plan(
+    const DependencyGraph::Addresses& addresses)
+{
+    // Create formula cells before taking pointers to them. A formula that
+    // reads one not yet evaluated sees Empty and fails as before
+    Plan plan(*account);
+    plan.steps.reserve(addresses.size());
+    for (const auto& cell_address : addresses) {
+        auto program_it = programs.find(cell_address);
+        if (program_it != programs.end()) {
+            auto coords = address_to_coords(cell_address);
+            auto& cell = cells[coords.first]
+                             .try_emplace(coords.second, CellState::Empty)
+                             .first->second;
+            plan.steps.push_back({&cell, &program_it->second, 0, 0});
+        }
+        else {
+            plan.steps.push_back({nullptr, nullptr, 0, 0});
+        }
+    }
+
+    // Resolve operands of each formula to cells or adopted numbers
+    for (auto& step : plan.steps) {
+        step.first_operand = plan.operands.size();
+        if (step.program == nullptr) continue;
+        for (const auto& op : *step.program) {
+            if (op.kind == Op::Kind::Reference) {
+                auto [col, row] = op.coords;
+                auto& column = cells[col];
+                auto row_it = column.find(row);
+                Operand operand;
+                if (row_it != column.end()) {
+                    operand.cell = &row_it->second;
+                }
+                else {
+                    operand.number = adopted_number(col, row);
+                }
+                plan.operands.push_back(operand);
+            }
+        }
+        step.operand_count = plan.operands.size() - step.first_operand;
+    }
+    return plan;
+}
+
+void Spreadsheet::evaluate_step(const Plan& plan, std::size_t i)
+{
+    const auto& step = plan.steps[i];
+    if (step.program != nullptr) {
+        *step.target = evaluate_program(
+            *step.program, plan.operands.data() + step.first_operand);
+    }
+}
+
+// Evaluates the graph with each cycle solved by Gauss-Seidel iteration:
+// its members are evaluated in turn, each reading the latest values of
+// the others, until a sweep moves no value by more than
+// iteration_tolerance or iteration_limit sweeps are done. Components go
+// level by level over the condensed graph. Those in one level cannot
+// read each other, so cells run in parallel chunks and cycles are handed
+// out to thread_count threads one at a time
+void Spreadsheet::evaluate_iterative(const DependencyGraph& graph,
+                                     const Plan& plan,
+                                     const GraphOrder& sorted)
+{
+    std::size_t n = graph.addresses.size();
+    const auto& component = sorted.component;
+
+    // Members of each component, listed under the id it goes by
+    std::vector<int> member_offsets(n + 1, 0);
+    for (std::size_t v = 0; v < n; ++v) ++member_offsets[component[v] + 1];
+    std::partial_sum(member_offsets.begin(), member_offsets.end(),
+                     member_offsets.begin());
+    std::vector<int> members(n);
+    auto fill = member_offsets;
+    for (std::size_t v = 0; v < n; ++v) {
+        members[fill[component[v]]++] = static_cast<int>(v);
+    }
+
+    // Condensed graph, with nodes that do not name a component skipped
+    std::vector<int> offsets(n + 1, 0);
+    std::vector<int> edges;
+    std::vector<char> skipped(n);
+    for (std::size_t r = 0; r < n; ++r) {
+        skipped[r] = component[r] != static_cast<int>(r);
+        for (int i = member_offsets[r]; i < member_offsets[r + 1]; ++i) {
+            int u = members[i];
+            for (int e = graph.edge_offsets[u]; e < graph.edge_offsets[u + 1];
+                 ++e) {
+                int w = component[graph.edges[e]];
+                if (w != static_cast<int>(r)) edges.push_back(w);
+            }
+        }
+        offsets[r + 1] = static_cast<int>(edges.size());
+    }
+
+    auto iterate = [&](int r) {
+        for (int sweep = 0; sweep < iteration_limit; ++sweep) {
+            bool settled = true;
+            for (int i = member_offsets[r]; i < member_offsets[r + 1]; ++i) {
+                const auto* target = plan.steps[members[i]].target;
+                if (target == nullptr) continue;
+                auto before = *target;
+                evaluate_step(plan, members[i]);
+                if (std::holds_alternative<int>(before) &&
+                    std::holds_alternative<int>(*target)) {
+                    auto change = std::int64_t{std::get<int>(*target)} -
+                                  std::get<int>(before);
+                    settled =
+                        settled && std::abs(change) <= iteration_tolerance;
+                }
+                else {
+                    settled = settled && before == *target;
+                }
+            }
+            if (settled) break;
+        }
+    };
+
+    for (const auto& level : assign_levels(offsets, edges, skipped)) {
+        std::vector<int> cycles;
+        for (int r : level) {
+            if (sorted.on_cycle[r]) cycles.push_back(r);
+        }
+        parallel_for(level.size(), [&](std::size_t first, std::size_t last,
+                                       std::size_t) {
+            for (auto i = first; i < last; ++i) {
+                if (!sorted.on_cycle[level[i]]) evaluate_step(plan, level[i]);
+            }
+        });
+
+        std::atomic<std::size_t> next_cycle{0};
+        auto worker = [&]() {
+            for (auto i = next_cycle++; i < cycles.size(); i = next_cycle++) {
+                iterate(cycles[i]);
+            }
+        };
+        std::vector<std::thread> workers;
+        auto threads = std::min<std::size_t>(thread_count, cycles.size());
+        for (std::size_t t = 1; t < threads; ++t) workers.emplace_back(worker);
+        worker();
+        for (auto& w : workers) w.join();
+    }
+}
+
+// Evaluates the plan of graph level by level on thread_count threads,
+// with chains contracted into tasks and each level packed into batches of
+// similar cost. Plan steps must be indexed by node id
+void Spreadsheet::evaluate_parallel(const DependencyGraph& graph,
+                                    const Plan& plan,
+                                    const std::vector<char>& on_cycle,
+                                    RowProgress* progress)
+{
+    // Chains never mix cycle members with other formulas, so a task is
+    // skipped as a whole
+    auto tasks = contract_chains(graph);
+    std::vector<int> task_of(graph.addresses.size(), -1);
+    std::vector<char> skipped(tasks.size(), 0);
+    for (int t = 0; t < static_cast<int>(tasks.size()); ++t) {
+        for (int v : tasks[t].nodes) task_of[v] = t;
+        skipped[t] = on_cycle[tasks[t].nodes.front()];
+    }
+
+    // Task graph in CSR form
+    std::vector<int> task_offsets{0};
+    std::vector<int> task_edges;
+    for (int t = 0; t < static_cast<int>(tasks.size()); ++t) {
+        auto first = task_edges.size();
+        for (int v : tasks[t].nodes) {
+            for (int e = graph.edge_offsets[v]; e < graph.edge_offsets[v + 1];
+                 ++e) {
+                int w = task_of[graph.edges[e]];
+                if (w != t) task_edges.push_back(w);
+            }
+        }
+        std::sort(task_edges.begin() + first, task_edges.end());
+        task_edges.erase(
+            std::unique(task_edges.begin() + first, task_edges.end()),
+            task_edges.end());
+        task_offsets.push_back(static_cast<int>(task_edges.size()));
+    }
+    auto levels = assign_levels(task_offsets, task_edges, skipped);
+
+    // Split each level into batches of roughly equal cost. Tasks go in
+    // decreasing cost so the cheap ones even out the tail
+    int threads = static_cast<int>(thread_count);
+    std::vector<std::vector<std::size_t>> batch_bounds(levels.size());
+    for (std::size_t l = 0; l < levels.size(); ++l) {
+        auto& level = levels[l];
+        std::sort(level.begin(), level.end(), [&](int a, int b) {
+            return tasks[a].cost > tasks[b].cost;
+        });
+        long long level_cost = 0;
+        for (int t : level) level_cost += tasks[t].cost;
+        long long target =
+            std::max(level_cost / (threads * batches_per_thread), 1LL);
+
+        auto& bounds = batch_bounds[l];
+        bounds.push_back(0);
+        long long batch_cost = 0;
+        for (std::size_t i = 0; i < level.size(); ++i) {
+            batch_cost += tasks[level[i]].cost;
+            if (batch_cost >= target || i + 1 == level.size()) {
+                bounds.push_back(i + 1);
+                batch_cost = 0;
+            }
+        }
+    }
+
+    std::atomic<std::size_t> next_batch{0};
+    std::size_t current_level = 0;
+    auto next_level = [&]() noexcept {
+        ++current_level;
+        next_batch = 0;
+        if (progress != nullptr) emit_completed_rows(*progress);
+    };
+    std::barrier sync(threads, next_level);
+    auto worker = [&]() {
+        while (current_level < levels.size()) {
+            const auto& level = levels[current_level];
+            const auto& bounds = batch_bounds[current_level];
+            for (std::size_t b = next_batch++; b + 1 < bounds.size();
+                 b = next_batch++) {
+                for (auto i = bounds[b]; i < bounds[b + 1]; ++i) {
+                    for (int v : tasks[level[i]].nodes) {
+                        evaluate_step(plan, v);
+                        if (progress != nullptr) {
+                            --progress->pending[progress->node_rows[v]];
+                        }
+                    }
+                }
+            }
+            sync.arrive_and_wait();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i) workers.emplace_back(worker);
+    worker();
+    for (auto& w : workers) w.join();
+}
+
+// Calls body(first, last, chunk) on up to thread_count disjoint chunks
+// covering [0, count). Chunk c is always handled by the same call
+template <typename Body>
+void Spreadsheet::parallel_for(std::size_t count, Body body)
+{
+    std::size_t chunks =
+        std::min<std::size_t>(thread_count, count / parallel_grain);
+    if (chunks <= 1) {
+        body(std::size_t{0}, count, std::size_t{0});
+        return;
+    }
+    std::vector<std::thread> workers;
+    for (std::size_t c = 1; c < chunks; ++c) {
+        workers.emplace_back(body, count * c / chunks,
+                             count * (c + 1) / chunks, c);
+    }
+    body(std::size_t{0}, count / chunks, std::size_t{0});
+    for (auto& w : workers) w.join();
+}
+
+// Groups the nodes of an acyclic CSR graph into levels, where each node
+// comes after all its precedents. Skipped nodes and their edges are
+// ignored. Frontiers are expanded in parallel
+std::vector<std::vector<int>> Spreadsheet::assign_levels(
+    std::span<const int> offsets, std::span<const int> edges,
+    const std::vector<char>& skipped)
+{
+    std::size_t n = offsets.size() - 1;
+    std::vector<std::atomic<int>> remaining(n);
+    parallel_for(n, [&](std::size_t first, std::size_t last, std::size_t) {
+        for (auto v = first; v < last; ++v) remaining[v].store(0);
+    });
+    parallel_for(n, [&](std::size_t first, std::size_t last, std::size_t) {
+        for (auto u = first; u < last; ++u) {
+            if (skipped[u]) continue;
+            for (int e = offsets[u]; e < offsets[u + 1]; ++e) {
+                if (!skipped[edges[e]]) remaining[edges[e]].fetch_add(1);
+            }
+        }
+    });
+
+    std::vector<std::vector<int>> found(thread_count);
+    auto gather = [&]() {
+        std::vector<int> frontier;
+        for (auto& part : found) {
+            frontier.insert(frontier.end(), part.begin(), part.end());
+            part.clear();
+        }
+        return frontier;
+    };
+    parallel_for(n, [&](std::size_t first, std::size_t last, std::size_t c) {
+        for (auto v = first; v < last; ++v) {
+            if (!skipped[v] && remaining[v].load() == 0) {
+                found[c].push_back(static_cast<int>(v));
+            }
+        }
+    });
+
+    std::vector<std::vector<int>> levels;
+    for (auto frontier = gather(); !frontier.empty(); frontier = gather()) {
+        parallel_for(frontier.size(), [&](std::size_t first, std::size_t last,
+                                          std::size_t c) {
+            for (auto i = first; i < last; ++i) {
+                int v = frontier[i];
+                for (int e = offsets[v]; e < offsets[v + 1]; ++e) {
+                    int w = edges[e];
+                    if (!skipped[w] && remaining[w].fetch_sub(1) == 1) {
+                        found[c].push_back(w);
+                    }
+                }
+            }
+        });
+        levels.push_back(std::move(frontier));
+    }
+    return levels;
+}
+
+// Formulas in cleared, if given, become plain cells with no edges into
+// them
+Spreadsheet::DependencyGraph Spreadsheet::build_graph(
+    const std::unordered_set<std::string>* cleared) const
+{
+    auto skipped = [&](const std::string& address) {
+        return cleared != nullptr && cleared->contains(address);
+    };
+    DependencyGraph graph(*account);
+    graph.addresses.reserve(dependencies.size());
+    graph.ids.reserve(dependencies.size());
+    for (const auto& [key, val] : dependencies) {
+        graph.ids.emplace(key, static_cast<int>(graph.addresses.size()));
+        graph.addresses.push_back(key);
+        auto program_it = programs.find(key);
+        graph.programs.push_back(program_it != programs.end() && !skipped(key)
+                                     ? &program_it->second
+                                     : nullptr);
+    }
+
+    graph.edge_offsets.reserve(graph.addresses.size() + 1);
+    graph.edge_offsets.push_back(0);
+    for (const auto& [key, val] : dependencies) {
+        auto first = graph.edges.size();
+        for (const auto& dependent : val.second) {
+            if (!skipped(dependent)) {
+                graph.edges.push_back(graph.ids[dependent]);
+            }
+        }
+        std::sort(graph.edges.begin() + first, graph.edges.end());
+        graph.edges.erase(
+            std::unique(graph.edges.begin() + first, graph.edges.end()),
+            graph.edges.end());
+        graph.edge_offsets.push_back(static_cast<int>(graph.edges.size()));
+    }
+    return graph;
+}
+
+// Static estimate of the work needed to evaluate a formula
+int Spreadsheet::formula_cost(const Program& program) const
+{
+    return static_cast<int>(program.size());
+}
+
+// Coarsens the formula graph by contracting linear chains, i.e. runs where
+// each formula is the only formula reading the previous one and reads no
+// other formula (running totals). Every formula lands in exactly one task
+std::vector<Spreadsheet::Task> Spreadsheet::contract_chains(
+    const DependencyGraph& graph)
+{
+    int n = static_cast<int>(graph.addresses.size());
+    std::vector<int> formula_precedents(n, 0);
+    std::vector<int> formula_dependents(n, 0);
+    std::vector<int> precedent(n, -1);
+    std::vector<int> dependent(n, -1);
+    for (int u = 0; u < n; ++u) {
+        if (graph.programs[u] == nullptr) continue;
+        for (int e = graph.edge_offsets[u]; e < graph.edge_offsets[u + 1];
+             ++e) {
+            int v = graph.edges[e];
+            ++formula_dependents[u];
+            ++formula_precedents[v];
+            dependent[u] = v;
+            precedent[v] = u;
+        }
+    }
+
+    // A formula continues its precedent's chain if the link is exclusive
+    auto continues_chain = [&](int v) {
+        int u = precedent[v];
+        return formula_precedents[v] == 1 && u != v &&
+               formula_dependents[u] == 1;
+    };
+
+    std::vector<Task> tasks;
+    std::vector<bool> assigned(n, false);
+    auto add_chain = [&](int head) {
+        Task task;
+        for (int v = head; v != -1 && !assigned[v];) {
+            assigned[v] = true;
+            task.nodes.push_back(v);
+            task.cost += formula_cost(*graph.programs[v]);
+            int next = dependent[v];
+            v = (formula_dependents[v] == 1 && next != -1 &&
+                 continues_chain(next))
+                    ? next
+                    : -1;
+        }
+        tasks.push_back(std::move(task));
+    };
+    for (int v = 0; v < n; ++v) {
+        if (graph.programs[v] != nullptr && !continues_chain(v)) {
+            add_chain(v);
+        }
+    }
+
+    // Formulas left over lie on rings of exclusive links, i.e. cycles
+    for (int v = 0; v < n; ++v) {
+        if (graph.programs[v] != nullptr && !assigned[v]) {
+            add_chain(v);
+        }
+    }
+    return tasks;
+}
+
+// Sorts topologically with an iterative Tarjan pass. Members of strongly
+// connected components with more than one cell, or that reference
+// themselves, are flagged as lying on a cycle
+Spreadsheet::GraphOrder Spreadsheet::topological_sort_dependencies(
+    const DependencyGraph& graph) const
+{
+    int n = static_cast<int>(graph.addresses.size());
+    GraphOrder res;
+    res.order.reserve(n);
+    res.on_cycle.assign(n, 0);
+    res.component.assign(n, 0);
+
+    std::vector<int> index(n, -1);
+    std::vector<int> lowlink(n, 0);
+    std::vector<char> on_stack(n, 0);
+    std::vector<int> component;
+    std::vector<std::pair<int, int>> path;  // node, next edge to visit
+    int counter = 0;
+    auto visit = [&](int v) {
+        index[v] = lowlink[v] = counter++;
+        component.push_back(v);
+        on_stack[v] = 1;
+        path.emplace_back(v, graph.edge_offsets[v]);
+    };
+
+    for (int root = 0; root < n; ++root) {
+        if (index[root] != -1) continue;
+        visit(root);
+        while (!path.empty()) {
+            auto [v, e] = path.back();
+            if (e < graph.edge_offsets[v + 1]) {
+                ++path.back().second;
+                int w = graph.edges[e];
+                if (index[w] == -1) {
+                    visit(w);
+                }
+                else if (on_stack[w]) {
+                    lowlink[v] = std::min(lowlink[v], index[w]);
+                }
+                continue;
+            }
+
+            path.pop_back();
+            if (!path.empty()) {
+                int u = path.back().first;
+                lowlink[u] = std::min(lowlink[u], lowlink[v]);
+            }
+            if (lowlink[v] != index[v]) continue;
+
+            // v roots a component. Components complete dependents first
+            auto first = std::find(component.rbegin(), component.rend(), v);
+            bool cycle = first != component.rbegin() ||
+                         has_self_reference(graph, v);
+            for (auto it = component.rbegin(); it != std::next(first); ++it) {
+                on_stack[*it] = 0;
+                res.on_cycle[*it] = cycle;
+                res.component[*it] = v;
+                res.order.push_back(*it);
+            }
+            component.erase(std::next(first).base(), component.end());
+        }
+    }
+    std::reverse(res.order.begin(), res.order.end());
+    return res;
+}
+
+// Parallel counterpart of topological_sort_dependencies giving the same
+// cycle flags. Cells that cannot be on a cycle are trimmed first, the rest
+// is split into components by forward-backward reachability from a pivot,
+// and the order comes from parallel level assignment
+Spreadsheet::GraphOrder Spreadsheet::analyse_graph_parallel(
+    const DependencyGraph& graph)
+{
+    std::size_t n = graph.addresses.size();
+    GraphOrder res;
+    res.on_cycle.assign(n, 0);
+    res.component.resize(n);
+    std::iota(res.component.begin(), res.component.end(), 0);
+
+    // Precedent edges in CSR form, filled by counting
+    std::vector<std::atomic<int>> counts(n);
+    parallel_for(n, [&](std::size_t first, std::size_t last, std::size_t) {
+        for (auto v = first; v < last; ++v) counts[v].store(0);
+    });
+    parallel_for(n, [&](std::size_t first, std::size_t last, std::size_t) {
+        for (auto u = first; u < last; ++u) {
+            for (int e = graph.edge_offsets[u]; e < graph.edge_offsets[u + 1];
+                 ++e) {
+                counts[graph.edges[e]].fetch_add(1);
+            }
+        }
+    });
+    std::vector<int> precedent_offsets(n + 1, 0);
+    for (std::size_t v = 0; v < n; ++v) {
+        precedent_offsets[v + 1] = precedent_offsets[v] + counts[v].load();
+        counts[v].store(precedent_offsets[v]);
+    }
+    std::vector<int> precedents(graph.edges.size());
+    parallel_for(n, [&](std::size_t first, std::size_t last, std::size_t) {
+        for (auto u = first; u < last; ++u) {
+            for (int e = graph.edge_offsets[u]; e < graph.edge_offsets[u + 1];
+                 ++e) {
+                precedents[counts[graph.edges[e]].fetch_add(1)] =
+                    static_cast<int>(u);
+            }
+        }
+    });
+
+    // Trim cells without live precedents or dependents, repeatedly
+    std::vector<std::atomic<int>> live_in(n);
+    std::vector<std::atomic<int>> live_out(n);
+    std::vector<std::atomic<char>> trimmed(n);
+    std::vector<std::vector<int>> found(thread_count);
+    auto gather = [&]() {
+        std::vector<int> frontier;
+        for (auto& part : found) {
+            frontier.insert(frontier.end(), part.begin(), part.end());
+            part.clear();
+        }
+        return frontier;
+    };
+    parallel_for(n, [&](std::size_t first, std::size_t last, std::size_t c) {
+        for (auto v = first; v < last; ++v) {
+            live_in[v].store(precedent_offsets[v + 1] - precedent_offsets[v]);
+            live_out[v].store(graph.edge_offsets[v + 1] -
+                              graph.edge_offsets[v]);
+            bool trim = live_in[v].load() == 0 || live_out[v].load() == 0;
+            trimmed[v].store(trim);
+            if (trim) found[c].push_back(static_cast<int>(v));
+        }
+    });
+    for (auto frontier = gather(); !frontier.empty(); frontier = gather()) {
+        parallel_for(frontier.size(), [&](std::size_t first, std::size_t last,
+                                          std::size_t c) {
+            for (auto i = first; i < last; ++i) {
+                int v = frontier[i];
+                for (int e = graph.edge_offsets[v];
+                     e < graph.edge_offsets[v + 1]; ++e) {
+                    int w = graph.edges[e];
+                    if (live_in[w].fetch_sub(1) == 1 &&
+                        trimmed[w].exchange(1) == 0) {
+                        found[c].push_back(w);
+                    }
+                }
+                for (int e = precedent_offsets[v];
+                     e < precedent_offsets[v + 1]; ++e) {
+                    int u = precedents[e];
+                    if (live_out[u].fetch_sub(1) == 1 &&
+                        trimmed[u].exchange(1) == 0) {
+                        found[c].push_back(u);
+                    }
+                }
+            }
+        });
+    }
+
+    // Forward-backward decomposition of what is left. Each pending part
+    // has its own color; parts are disjoint, so threads work on them
+    // without further locking
+    std::vector<std::atomic<int>> color(n);
+    std::vector<int> untrimmed;
+    for (std::size_t v = 0; v < n; ++v) {
+        color[v].store(trimmed[v].load() ? -1 : 0);
+        if (!trimmed[v].load()) untrimmed.push_back(static_cast<int>(v));
+    }
+    std::vector<char> forward(n, 0);
+    std::vector<char> backward(n, 0);
+    std::atomic<int> next_color{1};
+
+    auto reach = [&](int pivot, int c, std::span<const int> offsets,
+                     std::span<const int> edges, std::vector<char>& seen) {
+        std::vector<int> stack{pivot};
+        seen[pivot] = 1;
+        while (!stack.empty()) {
+            int v = stack.back();
+            stack.pop_back();
+            for (int e = offsets[v]; e < offsets[v + 1]; ++e) {
+                int w = edges[e];
+                // Only this part's thread touches the flags of its cells,
+                // so the color is checked before the flag is read
+                if (color[w].load(std::memory_order_relaxed) == c && !seen[w]) {
+                    seen[w] = 1;
+                    stack.push_back(w);
+                }
+            }
+        }
+    };
+
+    // Splits off the component of the first cell; returns remaining parts
+    auto split = [&](std::vector<int>& part) {
+        std::vector<std::vector<int>> parts;
+        int pivot = part.front();
+        if (part.size() == 1) {
+            res.on_cycle[pivot] = has_self_reference(graph, pivot);
+            color[pivot].store(-1);
+            return parts;
+        }
+        int c = color[pivot].load();
+        reach(pivot, c, graph.edge_offsets, graph.edges, forward);
+        reach(pivot, c, precedent_offsets, precedents, backward);
+
+        std::vector<int> component, only_forward, only_backward, neither;
+        for (int v : part) {
+            if (forward[v] && backward[v]) component.push_back(v);
+            else if (forward[v]) only_forward.push_back(v);
+            else if (backward[v]) only_backward.push_back(v);
+            else neither.push_back(v);
+            forward[v] = backward[v] = 0;
+        }
+        bool cycle =
+            component.size() > 1 || has_self_reference(graph, pivot);
+        for (int v : component) {
+            res.on_cycle[v] = cycle;
+            res.component[v] = pivot;
+            color[v].store(-1);
+        }
+        for (auto* rest : {&only_forward, &only_backward, &neither}) {
+            if (rest->empty()) continue;
+            int rest_color = next_color++;
+            for (int v : *rest) color[v].store(rest_color);
+            parts.push_back(std::move(*rest));
+        }
+        return parts;
+    };
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<std::vector<int>> pending;
+    if (!untrimmed.empty()) pending.push_back(std::move(untrimmed));
+    int busy = 0;
+    auto worker = [&]() {
+        std::unique_lock lock(mutex);
+        while (true) {
+            ready.wait(lock, [&] { return !pending.empty() || busy == 0; });
+            if (pending.empty()) break;
+            auto part = std::move(pending.back());
+            pending.pop_back();
+            ++busy;
+            lock.unlock();
+            auto parts = split(part);
+            lock.lock();
+            for (auto& p : parts) pending.push_back(std::move(p));
+            --busy;
+            ready.notify_all();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < thread_count; ++i) workers.emplace_back(worker);
+    worker();
+    for (auto& w : workers) w.join();
+
+    // Cycle members are left out of the levels and go last
+    for (auto& level :
+         assign_levels(graph.edge_offsets, graph.edges, res.on_cycle)) {
+        res.order.insert(res.order.end(), level.begin(), level.end());
+    }
+    for (std::size_t v = 0; v < n; ++v) {
+        if (res.on_cycle[v]) res.order.push_back(static_cast<int>(v));
+    }
+    return res;
+}
+
+bool Spreadsheet::has_self_reference(const DependencyGraph& graph,
+                                     int v) const
+{
+    return std::binary_search(graph.edges.begin() + graph.edge_offsets[v],
+                              graph.edges.begin() + graph.edge_offsets[v + 1],
+                              v);
+}
+
+std::string Spreadsheet::coord_to_col(int n) const
+{
+    std::string result;
+    while (n >= 0) {
+        char letter = 'A' + (n % 26);
+        result = letter + result;
+        n /= 26;
+        --n;
+    }
+    return result;
+}
+
+int Spreadsheet::col_to_coord(const std::string& col) const
+{
+    int result = 0;
+    for (char ch : col) {
+        result = result * 26 + (ch - 'A');
+    }
+    return result;
+}
+
+std::string Spreadsheet::coords_to_address(
+    const std::pair<int, int>& coords) const
+{
+    return coord_to_col(coords.first) + std::to_string(coords.second);
+}
+
+// Coordinates of an address of letters then digits, counting columns as
+// col_to_coord does. Nothing if it is not one, or if its column or row
+// does not fit in an int
+std::optional<std::pair<int, int>> Spreadsheet::parse_address(
+    std::string_view address) const
+{
+    std::size_t idx = 0;
+    std::int64_t col = 0;
+    while (idx < address.size() &&
+           std::isalpha(static_cast<unsigned char>(address[idx]))) {
+        col = col * 26 + (address[idx] - 'A');
+        if (col > std::numeric_limits<int>::max()) return std::nullopt;
+        ++idx;
+    }
+    if (idx == 0 || idx == address.size()) return std::nullopt;
+    for (auto ch : address.substr(idx)) {
+        if (!std::isdigit(static_cast<unsigned char>(ch))) return std::nullopt;
+    }
+    int row = 0;
+    auto [end, error] =
+        std::from_chars(address.data() + idx, address.data() + address.size(),
+                        row);
+    if (error != std::errc()) return std::nullopt;
+    return std::pair{static_cast<int>(col), row};
+}
+
+// Coordinates of an address, or -1, -1 if parse_address rejects it
+std::pair<int, int> Spreadsheet::address_to_coords(
+    const std::string& address) const
+{
+    return parse_address(address).value_or(std::pair{-1, -1});
+}
+
+bool Spreadsheet::contains_letter(const std::string& str) const
+{
+    for (char ch : str) {
+        if (std::isalpha(ch)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Spreadsheet::is_letter_number_format(const std::string& cell) const
+{
+    return parse_address(cell).has_value();
+}
+
+bool Spreadsheet::is_empty(const CellValue& cell)
+{
+    return std::holds_alternative<CellState>(cell) &&
+           std::get<CellState>(cell) == CellState::Empty;
+}
+
+bool Spreadsheet::is_error(const CellValue& cell) const
+{
+    return std::holds_alternative<CellState>(cell) &&
+           std::get<CellState>(cell) == CellState::Error;
+}
+
+// Number at the coordinates in an adopted column, or nullptr if there is
+// none. Cells in cells shadow it
+const int* Spreadsheet::adopted_number(int col, int row) const
+{
+    if (col < static_cast<int>(adopted.size()) && row >= 0 &&
+        row < static_cast<int>(adopted[col].size())) {
+        return &adopted[col][row];
+    }
+    return nullptr;
+}
+
+// Where the value of a cell is held: in cells or the adopted columns of
+// this sheet, or else of the sheets it was cloned from
+Spreadsheet::Operand Spreadsheet::lookup(int col, int row) const
+{
+    for (auto sheet = this; sheet != nullptr; sheet = sheet->base.get()) {
+        auto col_it = sheet->cells.find(col);
+        if (col_it != sheet->cells.end()) {
+            auto row_it = col_it->second.find(row);
+            if (row_it != col_it->second.end()) return {&row_it->second};
+        }
+        if (const int* number = sheet->adopted_number(col, row)) {
+            return {nullptr, number};
+        }
+    }
+    return {};
+}
+
+// Kind of the cell at col, row, with value set if it is a number
+Spreadsheet::CellKind Spreadsheet::read_cell(int col, int row,
+                                             int& value) const
+{
+    auto operand = lookup(col, row);
+    if (operand.number != nullptr) {
+        value = *operand.number;
+        return CellKind::Number;
+    }
+    if (operand.cell == nullptr) return CellKind::Empty;
+    if (const auto* number = std::get_if<int>(operand.cell)) {
+        value = *number;
+        return CellKind::Number;
+    }
+    return is_error(*operand.cell) ? CellKind::Error : CellKind::Empty;
+}
+
+// Whether any cell of the column was created, even if none is in the
+// row being printed
+bool Spreadsheet::has_column(int col) const
+{
+    for (auto sheet = this; sheet != nullptr; sheet = sheet->base.get()) {
+        if (sheet->cells.contains(col) ||
+            col < static_cast<int>(sheet->adopted.size())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::size_t Spreadsheet::accounted_bytes() const
+{
+    std::size_t bytes = 0;
+    for (const auto& counters : account->areas) {
+        bytes += counters.bytes.load(std::memory_order_relaxed);
+    }
+    return bytes;
+}
+
+Spreadsheet::MemoryUsage Spreadsheet::memory_usage(MemoryArea area) const
+{
+    const auto& counters = (*account)[area];
+    MemoryUsage usage;
+    usage.bytes = counters.bytes.load(std::memory_order_relaxed);
+    usage.peak_bytes = counters.peak_bytes.load(std::memory_order_relaxed);
+    usage.used_bytes = counters.used_bytes.load(std::memory_order_relaxed);
+    usage.blocks = counters.blocks.load(std::memory_order_relaxed);
+    usage.total_blocks = counters.total_blocks.load(std::memory_order_relaxed);
+    return usage;
+}
+
+void Spreadsheet::print_memory(std::ostream& out) const
+{
+    static const char* const names[] = {"cells",    "dependencies", "formulas",
+                                        "programs", "evaluation",   "parsing"};
+    for (int area = 0; area < static_cast<int>(MemoryArea::Count); ++area) {
+        auto usage = memory_usage(static_cast<MemoryArea>(area));
+        out << names[area] << ": " << usage.bytes << " bytes in "
+            << usage.blocks << " blocks, " << usage.used_bytes
+            << " used, peak " << usage.peak_bytes << " bytes, "
+            << usage.total_blocks << " blocks allocated\n";
+    }
+}
+
+void Spreadsheet::print_dependencies()
+{
+    for (const auto& [key, val] : dependencies) {
+        std::cout << key << " formula: " << val.first << std::endl;
+        std::cout << "Downstream dependencies -> ";
+        for (const auto& dep : val.second) {
+            std::cout << dep << ", ";
+        }
+        std::cout << "\b\b\n";
+    }
+}
+
+// Keeps sheets loaded and answers requests about them from clients on a
+// Unix domain socket or a loopback TCP port. One thread runs an epoll
+// loop over the listening sockets and the connections, and answers each
+// request as soon as its frame is in. Load and Recalculate take as long
+// as the sheet is big, so they go to a worker thread, one at a time, and
+// it posts them back through an eventfd to be replied to.
+//
+// Requests of a connection are answered in order: while its Load or
+// Recalculate is with the worker, the connection is not read. The loop
+// leaves a sheet alone while the worker has it, so requests on it from
+// other connections wait for the worker too. A connection is not read
+// either while more than max_pending_output of replies wait to be sent.
+//
+// Frames are a u32 length and that many bytes, integers little-endian. A
+// request is an Op byte and its fields, a reply a Status byte and its
+// fields. Sheets go by the u32 handle Load replies with, cells by u32
+// column and row, and a cell is replied as a CellKind byte and an i32:
+//   Load        path bytes                   -> handle
+//   Unload      handle                       ->
+//   Get         handle, col, row             -> cell
+//   Set         handle, col, row, i32        ->
+//   Range       handle, col, row, col, row   -> cols, rows, cells by row
+//   Recalculate handle                       ->
+// Load reads files under the load directory only, by paths relative to
+// it, and fails if none is set
+class SheetServer {
+   public:
+    enum class Op : std::uint8_t {
+        Load = 1,
+        Unload,
+        Get,
+        Set,
+        Range,
+        Recalculate
+    };
+    enum class Status : std::uint8_t { Ok, BadRequest, NoSheet, LoadFailed };
+
+    SheetServer();
+    ~SheetServer();
+    SheetServer(const SheetServer&) = delete;
+    SheetServer& operator=(const SheetServer&) = delete;
+
+    bool listen_unix(const std::string&);
+    bool listen_tcp(std::uint16_t);
+    bool set_load_directory(const std::string&);
+    std::uint32_t load(const std::string&);
+    void run();
+    void stop();
+
+    // Applied to sheets as they are loaded
+    void set_thread_count(unsigned count) { thread_count = count; }
+    void set_memory_budget(std::size_t bytes) { memory_budget = bytes; }
+
+   private:
+    // Largest request accepted. Bigger frames close the connection
+    static constexpr std::uint32_t max_request_size = 1 << 16;
+
+    // Most cells a Range request may cover
+    static constexpr std::uint64_t max_range_cells = 1 << 20;
+
+    // Reply bytes a connection may have waiting before it is no longer
+    // read
+    static constexpr std::size_t max_pending_output = 1 << 22;
+
+    // Events taken from epoll per wait
+    static constexpr int server_events = 64;
+
+    // Bytes read from a connection at a time
+    static constexpr std::size_t read_block_size = 1 << 16;
+
+    struct Connection {
+        std::uint64_t id = 0;  // tells a reused descriptor apart
+        std::string input;
+        std::string output;
+        std::size_t sent = 0;
+        std::uint32_t events = 0;  // watched for in epoll
+        bool queued = false;       // a request of its own is with the worker
+        bool blocked = false;      // its next request is on a busy sheet
+        bool ended = false;        // the client has shut down its writes
+
+        std::size_t pending() const { return output.size() - sent; }
+    };
+
+    // Load or Recalculate for the worker. It takes the sheet to
+    // recalculate out of sheets, or brings the one loaded, and gives it
+    // back when done
+    struct Job {
+        int fd = -1;
+        std::uint64_t connection = 0;
+        Op op = Op::Load;
+        std::string path;
+        std::uint32_t handle = 0;
+        std::unique_ptr<Spreadsheet> sheet;
+        bool failed = false;  // the recalculation threw
+    };
+
+    // What became of a request: replied to, handed to the worker, or left
+    // for later as its sheet is with the worker
+    enum class Handling { Answered, Queued, Blocked };
+
+    // Fields of a request, read front to back
+    struct Reader {
+        const char* data;
+        std::size_t size;
+        std::size_t pos = 0;
+
+        bool u32(std::uint32_t& value)
+        {
+            if (size - pos < 4) return false;
+            value = 0;
+            for (int i = 3; i >= 0; --i) {
+                value = value << 8 | static_cast<unsigned char>(data[pos + i]);
+            }
+            pos += 4;
+            return true;
+        }
+        bool coords(int& col, int& row)
+        {
+            std::uint32_t c = 0;
+            std::uint32_t r = 0;
+            if (!u32(c) || !u32(r)) return false;
+            if (c > std::numeric_limits<int>::max() ||
+                r > std::numeric_limits<int>::max()) {
+                return false;
+            }
+            col = static_cast<int>(c);
+            row = static_cast<int>(r);
+            return true;
+        }
+    };
+
+    static void put_u32(std::string& out, std::uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i) out += static_cast<char>(value >> 8 * i);
     }
 
-   private:
-    enum class CellState { Empty, Error };
+    // Writes the length of the frame that starts at at, once its body is
+    // in
+    static void end_frame(std::string& out, std::size_t at)
+    {
+        std::string size;
+        put_u32(size, static_cast<std::uint32_t>(out.size() - at - 4));
+        out.replace(at, 4, size);
+    }
 
-    using CellValue = std::variant<int, CellState>;
+    static bool can_read(const Connection& connection)
+    {
+        return !connection.queued && !connection.blocked &&
+               connection.pending() < max_pending_output;
+    }
 
-    // Spreadsheet dimensions
-    int max_col = 0;
-    int max_row = 0;
+    // Whether a whole frame, or one too big to take, waits in the input
+    static bool has_frame(const Connection& connection)
+    {
+        const auto& input = connection.input;
+        Reader frame{input.data(), input.size()};
+        std::uint32_t length = 0;
+        return frame.u32(length) &&
+               (length > max_request_size || input.size() - 4 >= length);
+    }
 
-    // Store cells
-    std::unordered_map<int, std::unordered_map<int, CellValue>> cells;
+    bool add_listener(int, const sockaddr*, socklen_t);
+    std::unique_ptr<Spreadsheet> open_sheet(const std::string&) const;
+    std::string loadable_path(const std::string&) const;
+    void watch(int, std::uint32_t, int);
+    Handling answer(int, const Connection&, const char*, std::size_t,
+                    std::string&);
+    bool answer_frames(int, Connection&);
+    bool receive(int, Connection&);
+    bool flush(int, Connection&);
+    bool serve(int, Connection&);
+    void close_connection(int);
+    void queue_job(Job);
+    void work();
+    void finish_jobs();
 
-    // Store dependencies. Maps to {formula, deps[]} pair
-    // NB: We are storing downstream dependencies
-    // i.e: if A0 -> A1, this means A1's formula contains A0
-    std::unordered_map<std::string,
-                       std::pair<std::string, std::vector<std::string>>>
-        dependencies;
+    // Sheets by handle. The entry of a sheet the worker has is null
+    std::unordered_map<std::uint32_t, std::unique_ptr<Spreadsheet>> sheets;
+    std::uint32_t next_handle = 1;
+    unsigned thread_count = 1;
+    std::size_t memory_budget = 0;
+    std::string load_directory;  // resolved, empty if Load is refused
 
-    bool contains_letter(const std::string&);
-    void calculate_postfix(std::pair<int, int>, const std::string&);
-    void parse_tokens(std::pair<int, int>, const std::string&);
-    void resolve_dependencies();
-    void resolve_references(const std::string&);
-    std::vector<std::string> topological_sort_dependencies();
-    bool topological_dfs_helper(const std::string&,
-                                std::unordered_set<std::string>&,
-                                std::unordered_set<std::string>&,
-                                std::vector<std::string>&);
-    int col_to_coord(const std::string&);
-    std::string coord_to_col(int);
-    std::string coords_to_address(const std::pair<int, int>&);
-    std::pair<int, int> address_to_coords(const std::string&);
-    bool is_letter_number_format(const std::string&);
-    void print_dependencies();
-    bool is_empty(const CellValue& cell);
-    bool is_error(const CellValue& cell);
+    std::vector<int> listeners;
+    std::string unix_path;  // unlinked when the server goes
+    std::unordered_map<int, Connection> connections;
+    std::uint64_t next_connection = 1;
+    int wake_fd;
+    int done_fd;  // counts jobs the worker has finished
+    int epoll_fd = -1;
+
+    // Jobs waiting for the worker and jobs it has finished, under mutex
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_ready;
+    std::deque<Job> jobs;
+    std::vector<Job> done;
+    bool working = false;
 };
 
-void Spreadsheet::parse_input(std::string file_name)
+SheetServer::SheetServer()
+    : wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      done_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
 {
-    std::ifstream file(file_name);
-    std::string line;
-    int row = 0;
-    int col = 0;
-    std::string col_s;
-    while (std::getline(file, line)) {
-        std::stringstream ss(line);
-        std::string cell;
-        col = 0;
-        while (std::getline(ss, cell, ',')) {
-            parse_tokens({col, row}, cell);
-            ++col;
-        }
-        max_col = std::max(max_col, col - 1);
-        ++row;
-    }
-    resolve_dependencies();
-    max_row = row - 1;
 }
 
-void Spreadsheet::print_output()
+SheetServer::~SheetServer()
 {
-    // Print column headers
-    std::cout << "\t";
-    for (int col = 0; col <= max_col; ++col) {
-        std::cout << coord_to_col(col) << "\t";
-    }
-    std::cout << std::endl;
-
-    // Print each row
-    for (int row = 0; row <= max_row; ++row) {
-        std::cout << row << "\t";
-        for (int col = 0; col <= max_col; ++col) {
-            auto col_it = cells.find(col);
-            if (col_it != cells.end()) {
-                auto row_it = col_it->second.find(row);
-                if (row_it != col_it->second.end()) {
-                    auto cell = row_it->second;
-                    if (std::holds_alternative<int>(cell)) {
-                        std::cout << std::get<int>(cell) << "\t";
-                    }
-                    else if (is_empty(cell)) {
-                        std::cout << "\t";
-                    }
-                    else if (is_error(cell)) {
-                        std::cout << "#ERR" << "\t";
-                    }
-                }
-                else {
-                    std::cout << "\t";
-                }
-            }
-        }
-        std::cout << std::endl;
+    for (int fd : listeners) close(fd);
+    if (!unix_path.empty()) unlink(unix_path.c_str());
+    if (wake_fd >= 0) close(wake_fd);
+    if (done_fd >= 0) close(done_fd);
+}
+
+// Listens on a Unix domain socket at path, replacing a stale socket
+// there. Any other file at the path is left alone and fails the call
+bool SheetServer::listen_unix(const std::string& path)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        return false;
     }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    struct stat info;
+    if (lstat(path.c_str(), &info) == 0) {
+        if (!S_ISSOCK(info.st_mode)) return false;
+        unlink(path.c_str());
+    }
+    else if (errno != ENOENT) {
+        return false;
+    }
+    if (!add_listener(AF_UNIX, reinterpret_cast<const sockaddr*>(&address),
+                      sizeof(address))) {
+        return false;
+    }
+    unix_path = path;
+    return true;
+}
 
-    // print_dependencies();
+// Listens on port of the loopback interface
+bool SheetServer::listen_tcp(std::uint16_t port)
+{
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return add_listener(AF_INET, reinterpret_cast<const sockaddr*>(&address),
+                        sizeof(address));
 }
 
-void Spreadsheet::parse_tokens(std::pair<int, int> cell_coords,
-                               const std::string& cell_contents)
+bool SheetServer::add_listener(int family, const sockaddr* address,
+                               socklen_t length)
 {
-    // If contains dependency, record dependencies and computation for later
-    if (contains_letter(cell_contents)) {
-        std::string cell_address = coords_to_address(cell_coords);
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    int on = 1;
+    if (family == AF_INET) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    if (bind(fd, address, length) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return false;
+    }
+    listeners.push_back(fd);
+    return true;
+}
 
-        // Check if cell exists in dependencies already. Update cell_contents
-        auto dep_it = dependencies.find(cell_address);
-        if (dep_it != dependencies.end()) {
-            dep_it->second.first = cell_contents;
-        }
-        else {
-            dependencies[cell_address] = {cell_contents, {}};
-        }
+// Lets Load requests read files under the directory. False if it is not
+// a directory
+bool SheetServer::set_load_directory(const std::string& directory)
+{
+    std::unique_ptr<char, decltype(&std::free)> resolved(
+        realpath(directory.c_str(), nullptr), &std::free);
+    struct stat info;
+    if (resolved == nullptr || stat(resolved.get(), &info) != 0 ||
+        !S_ISDIR(info.st_mode)) {
+        return false;
+    }
+    load_directory = resolved.get();
+    return true;
+}
 
-        // Update downstream dependencies
-        std::istringstream iss(cell_contents);
-        std::string token;
-        while (iss >> token) {
-            if (is_letter_number_format(token)) {
-                dependencies[token].second.push_back(cell_address);
-            }
-        }
+// Path a Load request for name reads: name resolved against the load
+// directory, links and dot segments included, if it stays under it.
+// Empty otherwise
+std::string SheetServer::loadable_path(const std::string& name) const
+{
+    if (load_directory.empty() || name.empty() ||
+        name.find('\0') != std::string::npos) {
+        return {};
     }
+    auto full = load_directory + '/' + name;
+    std::unique_ptr<char, decltype(&std::free)> resolved(
+        realpath(full.c_str(), nullptr), &std::free);
+    if (resolved == nullptr) return {};
+    std::string path = resolved.get();
+    auto prefix = load_directory == "/" ? load_directory : load_directory + '/';
+    if (path.compare(0, prefix.size(), prefix) != 0) return {};
+    return path;
+}
 
-    // Calculate prefix value
-    else {
-        calculate_postfix(cell_coords, cell_contents);
+// Loads a file as a new sheet. Returns its handle, or 0 if the file
+// cannot be read or is over the memory budget. Not for use while run()
+// is going
+std::uint32_t SheetServer::load(const std::string& file_name)
+{
+    auto sheet = open_sheet(file_name);
+    if (sheet == nullptr) return 0;
+    auto handle = next_handle++;
+    sheets.emplace(handle, std::move(sheet));
+    return handle;
+}
+
+// Sheet of a file, or null if it cannot be read, is over the memory
+// budget or fails to parse
+std::unique_ptr<Spreadsheet> SheetServer::open_sheet(
+    const std::string& file_name) const
+{
+    if (!std::ifstream(file_name)) return nullptr;
+    auto sheet = std::make_unique<Spreadsheet>();
+    sheet->set_thread_count(thread_count);
+    sheet->set_memory_budget(memory_budget);
+    try {
+        if (!sheet->parse_input(file_name)) return nullptr;
+    }
+    catch (const std::exception&) {
+        return nullptr;
     }
+    return sheet;
 }
 
-void Spreadsheet::calculate_postfix(std::pair<int, int> cell_coords,
-                                    const std::string& expression)
+// Makes run() return. Safe to call from any thread or a signal handler
+void SheetServer::stop()
 {
-    std::istringstream iss(expression);
-    std::string token;
-    std::stack<int> operands;
-    bool error = false;
-    while (iss >> token) {
-        if (token == "+" || token == "-" || token == "*" || token == "/") {
-            if (operands.size() < 2) {
-                error = true;
-                break;
-            }
+    std::uint64_t one = 1;
+    [[maybe_unused]] auto n = write(wake_fd, &one, sizeof(one));
+}
 
-            // Pop operands
-            int op1 = operands.top();
-            operands.pop();
-            int op2 = operands.top();
-            operands.pop();
+void SheetServer::watch(int fd, std::uint32_t events, int op)
+{
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, op, fd, &event);
+}
 
-            // Perform operation
-            int result;
-            if (token == "+") {
-                result = op1 + op2;
-            }
-            else if (token == "-") {
-                result = op1 - op2;
+// Runs the loop until stop(). The job the worker is on is finished
+// first; jobs it has not started are dropped, and a sheet that was
+// waiting to be recalculated goes back as it was
+void SheetServer::run()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) return;
+    watch(wake_fd, EPOLLIN, EPOLL_CTL_ADD);
+    watch(done_fd, EPOLLIN, EPOLL_CTL_ADD);
+    for (int fd : listeners) watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+    working = true;
+    std::thread worker(&SheetServer::work, this);
+
+    std::vector<epoll_event> events(server_events);
+    bool running = true;
+    while (running) {
+        int n = epoll_wait(epoll_fd, events.data(), server_events, -1);
+        if (n < 0 && errno != EINTR) break;
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd) {
+                running = false;
+                continue;
             }
-            else if (token == "*") {
-                result = op1 * op2;
+            if (fd == done_fd) {
+                finish_jobs();
+                continue;
             }
-            else if (token == "/") {
-                if (op2 == 0) {
-                    error = true;
-                    break;
+            if (std::find(listeners.begin(), listeners.end(), fd) !=
+                listeners.end()) {
+                int client;
+                while ((client = accept4(fd, nullptr, nullptr,
+                                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    int on = 1;
+                    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on,
+                               sizeof(on));
+                    auto& connection = connections[client];
+                    connection.id = next_connection++;
+                    connection.events = EPOLLIN;
+                    watch(client, EPOLLIN, EPOLL_CTL_ADD);
                 }
-                result = op1 / op2;
-            }
-            operands.push(result);
-        }
-        else {
-            try {
-                int number = std::stoi(token);
-                operands.push(number);
+                continue;
             }
-            catch (...) {
-                error = true;
-                break;
+
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            // Replies cannot reach a client that has gone
+            if ((events[i].events & (EPOLLHUP | EPOLLERR)) ||
+                !serve(fd, it->second)) {
+                close_connection(fd);
             }
         }
     }
-    cells[cell_coords.first][cell_coords.second] =
-        (operands.size() != 1 || error) ? CellState::Error
-                                        : CellValue(operands.top());
-}
-
-void Spreadsheet::resolve_dependencies()
-{
-    std::vector<std::string> sorted_dependencies =
-        topological_sort_dependencies();
 
-    for (const auto& cell_address : sorted_dependencies) {
-        resolve_references(cell_address);
-        if (!dependencies[cell_address].first.empty()) {
-            auto coords = address_to_coords(cell_address);
-            calculate_postfix(coords, dependencies[cell_address].first);
+    {
+        std::lock_guard lock(jobs_mutex);
+        working = false;
+    }
+    jobs_ready.notify_one();
+    worker.join();
+    for (auto& job : jobs) done.push_back(std::move(job));
+    jobs.clear();
+    for (auto& job : done) {
+        if (job.op == Op::Recalculate) {
+            sheets[job.handle] = std::move(job.sheet);
         }
     }
+    done.clear();
+
+    for (const auto& [fd, connection] : connections) close(fd);
+    connections.clear();
+    close(epoll_fd);
+    epoll_fd = -1;
+    std::uint64_t count;
+    [[maybe_unused]] auto drained = read(wake_fd, &count, sizeof(count));
+    drained = read(done_fd, &count, sizeof(count));
 }
 
-void Spreadsheet::resolve_references(const std::string& cell_address)
+void SheetServer::close_connection(int fd)
 {
-    const auto& formula = dependencies[cell_address].first;
-    std::string resolved_formula;
-    std::istringstream iss(formula);
-    std::string token;
-    while (iss >> token) {
-        if (is_letter_number_format(token)) {
-            auto coords = address_to_coords(token);
-            if (cells[coords.first].contains(coords.second)) {
-                if (std::holds_alternative<int>(
-                        cells[coords.first][coords.second])) {
-                    resolved_formula = resolved_formula + " " +
-                                       std::to_string(std::get<int>(
-                                           cells[coords.first][coords.second]));
-                }
-                else {  // Cell not an int, handle as error
-                    resolved_formula = "#ERR";
-                    break;
-                }
-            }
-            else {  // Cell not defined, handle as error
-                resolved_formula = "#ERR";
-                break;
-            }
-        }
-        else {
-            resolved_formula = resolved_formula + " " + token;
-        }
+    close(fd);
+    connections.erase(fd);
+}
+
+// Sends what the socket takes, answers what the client sent and watches
+// for what the connection can do next. Frames left in the input once the
+// replies drop below the cap are answered when the socket next takes
+// output, so one connection does not hold up the loop. A client that has
+// shut down its writes still gets the replies to all its whole frames.
+// False once it is to be closed
+bool SheetServer::serve(int fd, Connection& connection)
+{
+    if (!flush(fd, connection) || !receive(fd, connection) ||
+        !flush(fd, connection)) {
+        return false;
     }
-    dependencies[cell_address].first = resolved_formula;
+    if (connection.ended && connection.pending() == 0 && !connection.queued &&
+        !connection.blocked && !has_frame(connection)) {
+        return false;
+    }
+    std::uint32_t events = 0;
+    if (can_read(connection) && !connection.ended) events |= EPOLLIN;
+    if (connection.pending() > 0 ||
+        (can_read(connection) && has_frame(connection))) {
+        events |= EPOLLOUT;
+    }
+    if (events != connection.events) {
+        connection.events = events;
+        watch(fd, events, EPOLL_CTL_MOD);
+    }
+    return true;
 }
 
-// Sorts topologically, but also sets error values when cycles are detected
-std::vector<std::string> Spreadsheet::topological_sort_dependencies()
+// Answers the requests already read, then reads what the client sent a
+// block at a time, answering after each block. Reading stops while the
+// connection cannot be read, so its input and output stay bounded, and
+// for good at the end of the input. False on a read error or a frame
+// that is too big
+bool SheetServer::receive(int fd, Connection& connection)
 {
-    std::unordered_set<std::string> marked;
-    std::unordered_set<std::string> recStack;
-    std::vector<std::string> res;
-    for (const auto& [key, val] : dependencies) {
-        // Contains cycle: mark all cells on path as CellState::Error
-        if (!marked.contains(key) &&
-            topological_dfs_helper(key, marked, recStack, res)) {
-            for (const auto& cell : res) {
-                auto coords = address_to_coords(cell);
-                cells[coords.first][coords.second] = CellState::Error;
-            }
+    if (!answer_frames(fd, connection)) return false;
+    char block[read_block_size];
+    while (can_read(connection) && !connection.ended) {
+        auto n = read(fd, block, sizeof(block));
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        if (n == 0) {
+            connection.ended = true;
+            break;
         }
+        connection.input.append(block, static_cast<std::size_t>(n));
+        if (!answer_frames(fd, connection)) return false;
     }
-    return res;
+    return true;
 }
 
-// Returns true if cycle detected
-bool Spreadsheet::topological_dfs_helper(
-    const std::string& x, std::unordered_set<std::string>& marked,
-    std::unordered_set<std::string>& recStack, std::vector<std::string>& res)
+// Answers complete requests in the input while the connection can be
+// read. False on a frame that is too big
+bool SheetServer::answer_frames(int fd, Connection& connection)
 {
-    marked.insert(x);
-    recStack.insert(x);
-    bool has_cycle = false;
-    for (const auto& w : dependencies[x].second) {
-        if (recStack.contains(w)) {
-            res.insert(res.begin(),
-                       x);  // insert into res to later mark as #ERR
-            return true;
+    std::size_t pos = 0;
+    const auto& input = connection.input;
+    bool open = true;
+    while (can_read(connection) && input.size() - pos >= 4) {
+        Reader frame{input.data() + pos, 4};
+        std::uint32_t length = 0;
+        frame.u32(length);
+        if (length > max_request_size) {
+            open = false;
+            break;
         }
-        else if (!marked.contains(w)) {
-            has_cycle |= topological_dfs_helper(w, marked, recStack, res);
+        if (input.size() - pos - 4 < length) break;
+        auto at = connection.output.size();
+        connection.output.append(4, '\0');
+        auto handling = answer(fd, connection, input.data() + pos + 4, length,
+                               connection.output);
+        if (handling == Handling::Answered) {
+            end_frame(connection.output, at);
         }
+        else {
+            connection.output.resize(at);
+        }
+        if (handling == Handling::Blocked) {
+            connection.blocked = true;
+            break;
+        }
+        connection.queued = handling == Handling::Queued;
+        pos += 4 + length;
     }
-    res.insert(res.begin(), x);
-    recStack.erase(x);
-    return has_cycle;
+    connection.input.erase(0, pos);
+    return open;
 }
 
-std::string Spreadsheet::coord_to_col(int n)
+// Sends as much pending output as the socket takes
+bool SheetServer::flush(int fd, Connection& connection)
 {
-    std::string result;
-    while (n >= 0) {
-        char letter = 'A' + (n % 26);
-        result = letter + result;
-        n /= 26;
-        --n;
+    auto& output = connection.output;
+    while (connection.sent < output.size()) {
+        auto n = send(fd, output.data() + connection.sent,
+                      output.size() - connection.sent, MSG_NOSIGNAL);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        connection.sent += static_cast<std::size_t>(n);
     }
-    return result;
+    output.clear();
+    connection.sent = 0;
+    return true;
 }
 
-int Spreadsheet::col_to_coord(const std::string& col)
+// Appends the reply to one request, or hands it to the worker
+SheetServer::Handling SheetServer::answer(int fd,
+                                          const Connection& connection,
+                                          const char* data, std::size_t size,
+                                          std::string& reply)
 {
-    int result = 0;
-    for (char ch : col) {
-        result = result * 26 + (ch - 'A');
+    auto status = [&](Status value) {
+        reply += static_cast<char>(value);
+        return Handling::Answered;
+    };
+    auto put_cell = [&](const Spreadsheet& sheet, int col, int row) {
+        int value = 0;
+        auto kind = sheet.read_cell(col, row, value);
+        reply += static_cast<char>(kind);
+        put_u32(reply, static_cast<std::uint32_t>(value));
+    };
+    if (size == 0) return status(Status::BadRequest);
+    auto op = static_cast<Op>(data[0]);
+    Reader in{data, size, 1};
+
+    Job job;
+    job.fd = fd;
+    job.connection = connection.id;
+    job.op = op;
+    if (op == Op::Load) {
+        if (load_directory.empty()) return status(Status::LoadFailed);
+        job.path.assign(data + 1, size - 1);
+        queue_job(std::move(job));
+        return Handling::Queued;
     }
-    return result;
-}
 
-std::string Spreadsheet::coords_to_address(const std::pair<int, int>& coords)
-{
-    return coord_to_col(coords.first) + std::to_string(coords.second);
+    std::uint32_t handle = 0;
+    if (!in.u32(handle)) return status(Status::BadRequest);
+    auto it = sheets.find(handle);
+    if (it == sheets.end()) return status(Status::NoSheet);
+    if (it->second == nullptr) return Handling::Blocked;
+    auto& sheet = *it->second;
+
+    int col = 0;
+    int row = 0;
+    switch (op) {
+        case Op::Unload:
+            sheets.erase(it);
+            return status(Status::Ok);
+        case Op::Get:
+            if (!in.coords(col, row)) return status(Status::BadRequest);
+            status(Status::Ok);
+            put_cell(sheet, col, row);
+            return Handling::Answered;
+        case Op::Set: {
+            std::uint32_t value = 0;
+            if (!in.coords(col, row) || !in.u32(value)) {
+                return status(Status::BadRequest);
+            }
+            sheet.set_value(col, row, static_cast<int>(value));
+            return status(Status::Ok);
+        }
+        case Op::Range: {
+            int last_col = 0;
+            int last_row = 0;
+            if (!in.coords(col, row) || !in.coords(last_col, last_row) ||
+                last_col < col || last_row < row) {
+                return status(Status::BadRequest);
+            }
+            auto cols = static_cast<std::uint64_t>(last_col - col) + 1;
+            auto rows = static_cast<std::uint64_t>(last_row - row) + 1;
+            if (cols * rows > max_range_cells) {
+                return status(Status::BadRequest);
+            }
+            status(Status::Ok);
+            put_u32(reply, static_cast<std::uint32_t>(cols));
+            put_u32(reply, static_cast<std::uint32_t>(rows));
+            reply.reserve(reply.size() + cols * rows * 5);
+            for (int r = row; r <= last_row; ++r) {
+                for (int c = col; c <= last_col; ++c) put_cell(sheet, c, r);
+            }
+            return Handling::Answered;
+        }
+        case Op::Recalculate:
+            job.handle = handle;
+            job.sheet = std::move(it->second);
+            queue_job(std::move(job));
+            return Handling::Queued;
+        default:
+            return status(Status::BadRequest);
+    }
 }
 
-std::pair<int, int> Spreadsheet::address_to_coords(const std::string& address)
+void SheetServer::queue_job(Job job)
 {
-    int idx = 0;
-    while (idx < address.size() && std::isalpha(address[idx])) ++idx;
-    std::string col = address.substr(0, idx);
-    int row = std::stoi(address.substr(idx));
-    return {col_to_coord(col), row};
+    {
+        std::lock_guard lock(jobs_mutex);
+        jobs.push_back(std::move(job));
+    }
+    jobs_ready.notify_one();
 }
 
-bool Spreadsheet::contains_letter(const std::string& str)
+// Worker thread: runs jobs in the order they came until run() ends
+void SheetServer::work()
 {
-    for (char ch : str) {
-        if (std::isalpha(ch)) {
-            return true;
+    std::unique_lock lock(jobs_mutex);
+    while (true) {
+        jobs_ready.wait(lock, [&] { return !jobs.empty() || !working; });
+        if (!working) return;
+        auto job = std::move(jobs.front());
+        jobs.pop_front();
+        lock.unlock();
+        if (job.op == Op::Load) {
+            auto path = loadable_path(job.path);
+            if (!path.empty()) job.sheet = open_sheet(path);
+        }
+        else {
+            try {
+                job.sheet->recalculate();
+            }
+            catch (const std::exception&) {
+                job.failed = true;
+            }
         }
+        lock.lock();
+        done.push_back(std::move(job));
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto n = write(done_fd, &one, sizeof(one));
     }
-    return false;
 }
 
-bool Spreadsheet::is_letter_number_format(const std::string& cell)
+// Replies to the jobs the worker has finished and puts their sheets in
+// place, then lets connections waiting on those sheets go on. Sheets
+// loaded for a client that has gone are dropped
+void SheetServer::finish_jobs()
 {
-    std::regex pattern("^[A-Za-z]+[0-9]+$");
-    return std::regex_match(cell, pattern);
-}
+    std::vector<Job> finished;
+    {
+        std::lock_guard lock(jobs_mutex);
+        finished.swap(done);
+        std::uint64_t count;
+        [[maybe_unused]] auto n = read(done_fd, &count, sizeof(count));
+    }
 
-bool Spreadsheet::is_empty(const CellValue& cell)
-{
-    return std::holds_alternative<CellState>(cell) &&
-           std::get<CellState>(cell) == CellState::Empty;
-}
-bool Spreadsheet::is_error(const CellValue& cell)
-{
-    return std::holds_alternative<CellState>(cell) &&
-           std::get<CellState>(cell) == CellState::Error;
-}
+    for (auto& job : finished) {
+        auto it = connections.find(job.fd);
+        bool present =
+            it != connections.end() && it->second.id == job.connection;
+        std::string reply;
+        if (job.op == Op::Recalculate) {
+            sheets[job.handle] = std::move(job.sheet);
+            reply += static_cast<char>(job.failed ? Status::LoadFailed
+                                                  : Status::Ok);
+        }
+        else if (job.sheet == nullptr) {
+            reply += static_cast<char>(Status::LoadFailed);
+        }
+        else if (present) {
+            auto handle = next_handle++;
+            sheets.emplace(handle, std::move(job.sheet));
+            reply += static_cast<char>(Status::Ok);
+            put_u32(reply, handle);
+        }
+        if (!present) continue;
+        auto& connection = it->second;
+        put_u32(connection.output, static_cast<std::uint32_t>(reply.size()));
+        connection.output += reply;
+        connection.queued = false;
+    }
 
-void Spreadsheet::print_dependencies()
-{
-    for (const auto& [key, val] : dependencies) {
-        std::cout << key << " formula: " << val.first << std::endl;
-        std::cout << "Downstream dependencies -> ";
-        for (const auto& dep : val.second) {
-            std::cout << dep << ", ";
+    for (auto it = connections.begin(); it != connections.end();) {
+        auto& [fd, connection] = *it;
+        connection.blocked = false;
+        if (serve(fd, connection)) {
+            ++it;
+            continue;
         }
-        std::cout << "\b\b\n";
+        close(fd);
+        it = connections.erase(it);
     }
 }
 
-int main()
+// With --serve and a socket, serves the files given after it as sheets
+// 1, 2 and so on. The socket is a Unix domain socket path, or a port on
+// the loopback interface if it is a number, and is closed on SIGINT or
+// SIGTERM. Clients may load files of the directory given with --load-dir
+// right after the socket. Without arguments, prints the sample inputs
+// and runs the other entry points on them; expected_output.txt holds
+// what that prints
+int main(int argc, char** argv)
 {
+    if (argc >= 3 && std::string(argv[1]) == "--serve") {
+        static SheetServer server;
+        std::string socket = argv[2];
+        bool tcp = !socket.empty() &&
+                   std::all_of(socket.begin(), socket.end(), [](char ch) {
+                       return std::isdigit(static_cast<unsigned char>(ch));
+                   });
+        bool listening = false;
+        if (tcp) {
+            unsigned port = 0;
+            auto [end, error] = std::from_chars(
+                socket.data(), socket.data() + socket.size(), port);
+            if (error != std::errc() || port == 0 || port > 65535) {
+                std::cerr << "invalid port " << socket << '\n';
+                return 1;
+            }
+            listening = server.listen_tcp(static_cast<std::uint16_t>(port));
+        }
+        else {
+            listening = server.listen_unix(socket);
+        }
+        if (!listening) {
+            std::cerr << "cannot listen on " << socket << '\n';
+            return 1;
+        }
+        int first_file = 3;
+        if (argc >= 5 && std::string(argv[3]) == "--load-dir") {
+            if (!server.set_load_directory(argv[4])) {
+                std::cerr << "cannot load from " << argv[4] << '\n';
+                return 1;
+            }
+            first_file = 5;
+        }
+        for (int i = first_file; i < argc; ++i) {
+            if (server.load(argv[i]) == 0) {
+                std::cerr << "cannot load " << argv[i] << '\n';
+            }
+        }
+        std::signal(SIGINT, [](int) { server.stop(); });
+        std::signal(SIGTERM, [](int) { server.stop(); });
+        server.run();
+        return 0;
+    }
+
     Spreadsheet s;
     std::cout << "TEST 1: ---------------------------\n";
     s.parse_input("input.csv");
@@ -404,4 +5410,144 @@ int main()
     s.clear();
     s.parse_input("input4.csv");
     s.print_output();
+    std::cout << "TEST 5: ---------------------------\n";
+    s.clear();
+    s.parse_input("input5.csv");
+    s.print_output();
+    std::cout << "TEST 6: ---------------------------\n";
+    s.clear();
+    s.set_stream_window(2);
+    s.parse_input_pipelined("input6.csv");
+    s.set_stream_window(0);
+    std::cout << "TEST 7: ---------------------------\n";
+    s.clear();
+    s.parse_and_print("input2.csv");
+    std::cout << "TEST 8: ---------------------------\n";
+    s.clear();
+    s.set_memory_budget(1);
+    if (!s.parse_and_print("input2.csv")) std::cout << "over budget\n";
+    s.set_memory_budget(0);
+    std::cout << "TEST 9: ---------------------------\n";
+    s.clear();
+    s.parse_input("input2.csv");
+    s.insert_rows(1, 2);
+    s.delete_columns(0, 1);
+    s.insert_rows(4, 1);
+    s.recalculate();
+    s.print_output();
+    std::cout << "TEST 10: --------------------------\n";
+    s.clear();
+    s.parse_input("input7.csv");
+    s.print_output();
+    std::cout << "TEST 11: --------------------------\n";
+    s.clear();
+    s.set_thread_count(4);
+    s.parse_input("input7.csv");
+    s.print_output();
+    std::cout << "TEST 12: --------------------------\n";
+    if (s.write_output("input7.out")) {
+        std::cout << std::ifstream("input7.out").rdbuf();
+        std::remove("input7.out");
+    }
+    std::cout << "TEST 13: --------------------------\n";
+    s.clear();
+    s.print_report(s.analyse_input("input7.csv"));
+    s.set_thread_count(1);
+    std::cout << "TEST 14: --------------------------\n";
+    s.recalculate();
+    if (s.export_arrow("input7.arrow")) {
+        std::ifstream arrow("input7.arrow", std::ios::binary);
+        std::string bytes((std::istreambuf_iterator<char>(arrow)),
+                          std::istreambuf_iterator<char>());
+        std::cout << bytes.substr(0, 6) << ' ' << bytes.size() << " bytes\n";
+        std::remove("input7.arrow");
+    }
+    std::cout << "TEST 15: --------------------------\n";
+    const int column_a[] = {1, 2, 3};
+    const int column_b[] = {4, 5, 6};
+    const std::string formulas_b[] = {"", "A0 A1 +", ""};
+    s.clear();
+    s.import_columns({column_a, column_b}, {{}, formulas_b});
+    s.recalculate();
+    s.print_output();
+    std::cout << "TEST 16: --------------------------\n";
+    s.fill_formula("C", 0, 3, "A{r} B{r-1} *");
+    s.recalculate();
+    s.print_output();
+    std::cout << "TEST 17: --------------------------\n";
+    s.clear();
+    s.parse_input("input7.csv");
+    auto what_if = s.clone();
+    what_if.set_value("A0", 10);
+    what_if.recalculate();
+    what_if.print_output();
+    s.print_output();
+    std::cout << "TEST 18: --------------------------\n";
+    std::vector<std::string> outputs = {"A2", "E3"};
+    auto scenarios = s.evaluate_scenarios({{"A0", {1, 2, 3}}}, outputs);
+    for (std::size_t o = 0; o < outputs.size(); ++o) {
+        std::cout << outputs[o] << ':';
+        for (std::size_t i = 0; i < scenarios[o].values.size(); ++i) {
+            std::cout << ' ';
+            if (scenarios[o].errors[i]) {
+                std::cout << "#ERR";
+            }
+            else {
+                std::cout << scenarios[o].values[i];
+            }
+        }
+        std::cout << '\n';
+    }
+    std::cout << "TEST 19: --------------------------\n";
+    Spreadsheet::Distribution die{Spreadsheet::Distribution::Kind::Uniform, 1,
+                                  6};
+    auto stats = s.simulate({{"A0", die}}, outputs, 1000, 7);
+    for (std::size_t o = 0; o < outputs.size(); ++o) {
+        std::cout << outputs[o] << ": " << stats[o].count << " draws, mean "
+                  << stats[o].mean << ", percentiles";
+        for (int value : stats[o].percentiles) std::cout << ' ' << value;
+        std::cout << '\n';
+    }
+    std::cout << "TEST 20: --------------------------\n";
+    bool found = s.goal_seek("A0", "E3", 100, -1000, 1000);
+    int value = 0;
+    s.read_cell(0, 0, value);
+    std::cout << (found ? "found" : "closest") << " A0 = " << value << '\n';
+    std::cout << "TEST 21: --------------------------\n";
+    std::cout << "dependents of A3:";
+    for (const auto& address : s.dependents_of("A3")) {
+        std::cout << ' ' << address;
+    }
+    std::cout << "\nprecedents of E3:";
+    for (const auto& address : s.precedents_of("E3")) {
+        std::cout << ' ' << address;
+    }
+    std::cout << '\n';
+    std::cout << "TEST 22: --------------------------\n";
+    s.clear();
+    s.set_iteration(20);
+    s.parse_input("input8.csv");
+    s.print_output();
+    s.set_iteration(0);
+    std::cout << "TEST 23: --------------------------\n";
+    auto profile = s.profile_input("input7.csv");
+    std::cout << profile.rows << " rows, " << profile.columns << " columns, "
+              << profile.literal_cells << " literals, "
+              << profile.formula_cells << " formulas, "
+              << profile.formula_tokens << " tokens, " << profile.references
+              << " references, " << profile.referenced_cells
+              << " cells read\n";
+    std::cout << "TEST 24: --------------------------\n";
+    s.clear();
+    s.parse_input("input7.csv");
+    std::cout << "memory counted: "
+              << (s.memory_usage(MemoryArea::Cells).blocks > 0 &&
+                          s.accounted_bytes() > 0
+                      ? "yes"
+                      : "no")
+              << '\n';
+    std::cout << "TEST 25: --------------------------\n";
+    SheetServer server;
+    std::cout << "handles " << server.load("input5.csv") << ' '
+              << server.load("missing.csv") << '\n';
 }